@@ -5,8 +5,16 @@ mkdir dep
 g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/bob.o  src/bob.cpp
 g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/Rule.o  src/Rule.cpp
 g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/File.o src/File.cpp
-g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/Replace.o src/Replace.cpp
+g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/Expression.o src/Expression.cpp
 g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/RuleInstance.o src/RuleInstance.cpp
 g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/String.o src/String.cpp
-g++ -pthread -o bin/bob obj/bob.o obj/Rule.o obj/File.o obj/Replace.o obj/RuleInstance.o obj/String.o -lboost_filesystem -lboost_system -lre2
+g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/Snapshot.o src/Snapshot.cpp
+g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/Scan.o src/Scan.cpp
+g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/GitIndex.o src/GitIndex.cpp
+g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/Matcher.o src/Matcher.cpp
+g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/Pattern.o src/Pattern.cpp
+g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/Graph.o src/Graph.cpp
+g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/Depfile.o src/Depfile.cpp
+g++ -pthread -MMD -O3 -Wall -Wextra -fno-omit-frame-pointer -std=c++11 -g -Iinclude -c -o obj/Includes.o src/Includes.cpp
+g++ -pthread -o bin/bob obj/bob.o obj/Rule.o obj/File.o obj/Expression.o obj/RuleInstance.o obj/String.o obj/Snapshot.o obj/Scan.o obj/GitIndex.o obj/Matcher.o obj/Pattern.o obj/Graph.o obj/Depfile.o obj/Includes.o -lboost_filesystem -lboost_system -lre2
 
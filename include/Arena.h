@@ -0,0 +1,35 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <new>
+
+// Hands out slots for objects of type T carved from large blocks, for the graph nodes of which there are hundreds of
+// thousands that mostly live until bob exits. Each thread carves up a block of its own, so allocating takes no lock,
+// also when the scanner and matcher threads make files at the same time. Nothing is given back before the process
+// exits: a node that is deleted, such as a file that is pruned, leaves its slot unused, and the blocks are never
+// freed, so no worker that is still running at exit(), as after a failed command, can find its nodes gone.
+template <typename T, size_t blockSlots = 4096>
+class Arena {
+public:
+  static void *Allocate(size_t size) {
+    // Classes derived from T do not fit in a slot
+    if (size != sizeof(T)) return ::operator new(size);
+    static thread_local char *next = NULL;
+    static thread_local size_t left = 0;
+    if (!left) {
+      next = (char *)::operator new(sizeof(T) * blockSlots);
+      left = blockSlots;
+    }
+    void *slot = next;
+    next += sizeof(T);
+    left--;
+    return slot;
+  }
+  static void Release(void *slot, size_t size) {
+    if (size != sizeof(T)) ::operator delete(slot);
+  }
+};
+
+#endif
+
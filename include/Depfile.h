@@ -0,0 +1,83 @@
+#ifndef DEPFILE_H
+#define DEPFILE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+
+struct File;
+struct RuleInstance;
+class FileMap;
+
+// One "target: inputs" line of a dependency file, as gcc -MMD and the like write them
+struct DepfileRule {
+  std::string target;
+  std::vector<std::string> inputs;
+};
+
+// A set of inputs from dependency files, of files no rule makes, that is stored once for all the instances whose
+// dependency files list exactly those. Most objects in a tree depend on the same few hundred headers.
+struct DependencyList {
+  uint32_t id; // in DependencyLists::lists
+  std::vector<File *> files; // sorted
+  std::vector<RuleInstance *> users;
+};
+
+// Owns the dependency lists, numbered in the order they were made
+class DependencyLists {
+public:
+  DependencyLists() {}
+  ~DependencyLists();
+  // Finds the list with the same files, or makes one; takes the files, which need not be sorted or unique
+  DependencyList *Intern(std::vector<File *> &files);
+  std::vector<DependencyList *> lists;
+private:
+  DependencyLists(const DependencyLists &);
+  DependencyLists &operator=(const DependencyLists &);
+  std::unordered_map<uint64_t, std::vector<DependencyList *>> byHash;
+};
+
+extern DependencyLists dependencyLists;
+
+// Whether the path starts with one of the immutables prefixes, so that it is not tracked as a dependency
+bool isImmutable(const std::string &path);
+
+// Collects the inputs that dependency files or the include scanner find for rule instances. The ones a rule makes or
+// should make become edges of their own, so that they take part in invalidation and can be pruned as stale outputs;
+// the rest go in the shared list of the instance when Commit is called.
+class FoundInputs {
+public:
+  FoundInputs() : last(NULL), lastShared(NULL) {}
+  static bool IsMade(const File *input);
+  void Add(RuleInstance *ri, File *input, bool made);
+  void Commit();
+private:
+  std::vector<RuleInstance *> sharing;
+  std::unordered_map<RuleInstance *, std::vector<File *>> shared;
+  RuleInstance *last;
+  std::vector<File *> *lastShared;
+};
+
+// Appends the rules in the text of a dependency file, one for each target of a line. A backslash before a newline
+// continues the line, "\ " and "\#" are a space and a hash in a path, "$$" is a dollar sign and any other # starts a
+// comment. Other backslashes are kept, as they are part of Windows paths, and so is the colon after a drive letter.
+void parseDepfile(const char *data, size_t size, std::vector<DepfileRule> &rules);
+
+// Reads and parses one dependency file; false if it cannot be read, or is shorter than it was when opened. A small one
+// is read into buffer, which a caller can keep between calls.
+bool readDepfile(const std::string &path, std::vector<DepfileRule> &rules, std::vector<char> &buffer);
+
+// Reads the files among candidates that match a depfiles pattern on threadCount threads, and then adds the inputs
+// they list to the rule instances that make their targets, in the order of candidates. Targets that no rule makes
+// are skipped. Only dependency files that changed since depsLog has them are parsed, and recorded there again.
+// Inputs under one of the immutables prefixes are left out altogether.
+void loadDependencies(const std::vector<File *> &candidates, FileMap &fileMap, std::vector<File *> &files, FoundInputs &found, size_t threadCount);
+
+// Loads the dependency files made by the rule instances that roots need, through their inputs, and scans the includes
+// of the ones whose rule asks for that. Dependency files that no rule lists as an output are all loaded. The inputs found are followed as well, as they may lead to more instances,
+// such as ones that generate a header.
+void loadReachableDependencies(const std::vector<RuleInstance *> &roots, FileMap &fileMap, std::vector<File *> &files, size_t threadCount);
+
+#endif
+
@@ -0,0 +1,68 @@
+#ifndef EXPRESSION_H
+#define EXPRESSION_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include "Pattern.h"
+
+// Text with the captures of a rule match in it, as \1 to \9, split up front so that filling them in only copies
+class CaptureTemplate {
+public:
+  CaptureTemplate() {}
+  explicit CaptureTemplate(const std::string &text);
+  const std::string &Text() const { return text; }
+  bool UsesCaptures() const { return !pieces.empty(); }
+  // One more than the highest capture in the text
+  size_t CapturesUsed() const;
+  // Appends the text with the captures filled in. Without captures, or for a capture past captureCount, the \N is
+  // left as it is.
+  void Fill(std::string &out, const std::string *captures, size_t captureCount) const;
+private:
+  struct Piece {
+    std::string text; // up to the capture
+    size_t capture;
+  };
+  std::string text;
+  std::vector<Piece> pieces;
+  std::string tail;
+};
+
+// A Rulefile expression with its $(...) parts parsed once, so that evaluating it does not scan the text again
+class Expression {
+public:
+  // Why an expression could not be evaluated. A message saying where is printed along with it.
+  enum Error {
+    Ok,
+    UnclosedBrace,
+    UndefinedVariable,
+    UnknownFunction,
+    MissingArgument,
+  };
+  // The parsed form of a variable value, shared by every use of that value
+  static std::shared_ptr<const Expression> Get(const std::string &text);
+  Expression() : error(Ok) {}
+  explicit Expression(const std::string &text);
+  const std::string &Text() const { return text; }
+  // Appends the value to out. Variables are looked up in instancedVars first, then in the global variables. When
+  // captures are given, \1 to \9 in the expression's own text are replaced by them, as in the output of a rule.
+  Error Evaluate(const std::unordered_map<std::string, std::string> &instancedVars, std::string &out, const std::string *captures = NULL, size_t captureCount = 0) const;
+private:
+  // Sets instanced when a variable came from instancedVars, which means the value may differ between rules
+  Error Evaluate(const std::unordered_map<std::string, std::string> &instancedVars, std::string &out, const std::string *captures, size_t captureCount, bool &instanced) const;
+  struct Node {
+    enum Kind { Text, Variable, Sub, Filter, Subst, RepSubst };
+    Kind kind;
+    CaptureTemplate text;
+    CaptureTemplate pattern, target; // the arguments of a function that are taken as they are
+    std::shared_ptr<Expression> argument; // the name of a variable, or the list a function works on
+    std::shared_ptr<Pattern> compiled; // the pattern, unless it uses the rule's captures
+  };
+  std::string text;
+  std::vector<Node> nodes;
+  Error error;
+};
+
+#endif
+
@@ -6,41 +6,87 @@
 #include <boost/filesystem.hpp>
 #include <vector>
 #include <unordered_map>
+#include <cstdint>
+#include <iterator>
+#include "re2/stringpiece.h"
 
 class Rule;
 struct RuleInstance;
+struct DependencyList;
 
 struct File {
   File(const std::string &path) 
   : path(path)
   , generatingRule(NULL)
-  , shouldRebuild(false)
-  , lastWrite(1) 
+  , id(0)
   {
   }
-  void Invalidate();
-  void SignalRebuilt();
-  std::time_t timestamp() { 
-    if (lastWrite == 1) {
-      if (boost::filesystem::is_regular_file(path)) 
-        lastWrite = boost::filesystem::last_write_time(path);
-      else
-        lastWrite = 0;
-    }
-    return lastWrite;
-  }
+  // From an arena, as there is one for every file in the tree
+  static void *operator new(size_t size);
+  static void operator delete(void *file, size_t size);
   std::string path;
   RuleInstance *generatingRule;
-  bool shouldRebuild;
-  std::time_t lastWrite;
+  uint32_t id; // in the graph
+  // The instances that use the file while the graph is being made; Graph::Build moves them into its rows
   std::vector<RuleInstance *> dependencies;
+  std::vector<DependencyList *> lists; // the shared dependency lists it is in
+  // The first instance that uses it, directly or through a list, or NULL
+  RuleInstance *FirstUser() const;
+};
+
+// The files by path, in an open-addressing table that keeps the hash of each path next to its file. Probing only
+// compares the paths of files with the same hash, and growing the table never hashes a path again. The paths
+// themselves are only stored in the files.
+class FileMap {
+public:
+  explicit FileMap(size_t expected = 0);
+  File *Find(const re2::StringPiece &path) const;
+  // Returns the file that was already there for its path instead, if any
+  File *Insert(File *file);
+  // Makes room for this many files, so that adding them does not grow the table
+  void Reserve(size_t count);
+  size_t size() const { return count; }
+  class iterator {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef File *value_type;
+    typedef ptrdiff_t difference_type;
+    typedef File *const *pointer;
+    typedef File *const &reference;
+    iterator(const FileMap *map, size_t slot) : map(map), slot(slot) { Skip(); }
+    File *operator*() const { return map->slots[slot].file; }
+    iterator &operator++() { slot++; Skip(); return *this; }
+    bool operator==(const iterator &other) const { return slot == other.slot; }
+    bool operator!=(const iterator &other) const { return slot != other.slot; }
+  private:
+    friend class FileMap;
+    void Skip() { while (slot < map->slots.size() && map->slots[slot].hash < liveHash) slot++; }
+    const FileMap *map;
+    size_t slot;
+  };
+  // Inserting files while iterating may grow the table, which leaves the iterators invalid
+  iterator begin() const { return iterator(this, 0); }
+  iterator end() const { return iterator(this, slots.size()); }
+  // Removes the file from the map only, and leaves a marker in its slot so that the files after it can still be
+  // found. The caller deletes the file afterwards.
+  iterator erase(iterator it);
+private:
+  // A hash of 0 marks an empty slot and 1 an erased one; the hashes of paths are moved out of the way of those
+  enum { emptyHash = 0, erasedHash = 1, liveHash = 2 };
+  struct Slot {
+    uint64_t hash;
+    File *file;
+  };
+  static uint64_t Hash(const re2::StringPiece &path);
+  void Grow(size_t capacity);
+  std::vector<Slot> slots;
+  size_t count; // live files
+  size_t used; // live and erased slots
 };
 
-File* create_file(const std::string &fileName, std::unordered_map<std::string, File*> &fileMap, std::vector<File *>& files);
-void readFile(std::vector<Rule *> &rules, const std::string &path, std::unordered_map<std::string, File *> &fileMap, std::vector<File *>& files);
-bool readRuleFile(std::vector<Rule *> &rules, std::unordered_map<std::string, File *> &fileMap, std::vector<File *>& files);
-void loadDependenciesFrom(std::string &file, std::vector<Rule*> &rules, std::unordered_map<std::string, File *> &fileMap, std::vector<File *> &files);
-void getFiles(std::vector<File *> &files);
+File* create_file(const std::string &fileName, FileMap &fileMap, std::vector<File *>& files);
+void readFile(std::vector<Rule *> &rules, const std::string &path, FileMap &fileMap, std::vector<File *>& files, uint64_t *hash = NULL);
+bool readRuleFile(std::vector<Rule *> &rules, FileMap &fileMap, std::vector<File *>& files, uint64_t &hash);
 
 #endif
 
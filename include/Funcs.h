@@ -8,28 +8,33 @@
 #include <string>
 #include <vector>
 #include <queue>
+#include <cstdint>
 
 struct RuleInstance;
+class Pattern;
+struct CaptureArgs;
+// Orders instance ids in the graph by how long the builds after them take
 struct Comparer {
-  bool operator()(RuleInstance* first, RuleInstance* second);
+  bool operator()(uint32_t first, uint32_t second);
 };
 
-extern std::priority_queue<RuleInstance*, std::vector<RuleInstance*>, Comparer> runnable;
+extern std::priority_queue<uint32_t, std::vector<uint32_t>, Comparer> runnable;
 extern std::mutex runnableM;
 extern RE2::Set depfiles, generateds;
+extern std::vector<std::string> immutables;
 extern std::unordered_map<std::string, std::string> vars;
 extern std::string target;
 extern bool dryrun;
 extern bool verbose;
 
-std::string replaceVars(const std::string &arg, const std::unordered_map<std::string, std::string> &instancedVars);
 std::string regexToNoMatching(const std::string &r);
 std::vector<std::string> split(const std::string&str, char splitToken);
 void replace_all(std::string &input, const char *toReplace, const std::string &replaceant);
 std::string replace_matches(const std::string &input, const std::string* matches, char prefix, size_t count);
 size_t find_end_brace_balanced(const std::string& arg, size_t pos);
 size_t find_first_owned_space(const std::string& arg);
-std::string replace_with_pattern(const std::string& item, const RE2& pattern, const std::string& target);
+std::string replace_with_pattern(const std::string& item, const Pattern& pattern, const std::string& target, CaptureArgs &captures);
+uint64_t hash_bytes(const char *data, size_t length, uint64_t hash = 14695981039346656037ULL);
 
 #endif
 
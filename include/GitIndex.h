@@ -0,0 +1,26 @@
+#ifndef GITINDEX_H
+#define GITINDEX_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+struct IndexedDirectory {
+  std::vector<std::string> files;
+  std::vector<std::string> dirs;
+};
+
+// The tracked files from a git index, grouped by directory. Directory paths are relative to the work tree, with ""
+// for its root.
+struct GitIndex {
+  GitIndex() : lastWrite(0) {}
+  std::unordered_map<std::string, IndexedDirectory> directories;
+  uint64_t lastWrite;
+};
+
+// Returns false if there is no index, or it uses a format (split index, sparse checkout) that does not list every file.
+bool readGitIndex(const std::string &path, GitIndex &index);
+
+#endif
+
@@ -0,0 +1,61 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <cstdint>
+#include <ctime>
+#include <vector>
+#include "RuleInstance.h"
+
+struct File;
+class FileMap;
+class DependencyLists;
+
+// The build graph once it is complete, with the files and rule instances numbered by their id. Their build state is
+// kept in arrays indexed by id, and the edges in compressed rows: the inputs of instance i are inputFile from
+// inputStart[i] up to inputStart[i + 1], and the same goes for the outputs of an instance and the users of a file.
+struct Graph {
+  static const uint32_t NoId = 0xFFFFFFFF;
+  // Numbers the files and instances, and moves their edges in. The edges are taken out of the File and RuleInstance
+  // objects, which only keep what is needed to run a command.
+  void Build(const std::vector<RuleInstance *> &instances, FileMap &fileMap, const DependencyLists &dependencyLists);
+  std::vector<File *> files;
+  std::vector<RuleInstance *> instances;
+
+  // Per file
+  std::vector<uint32_t> generator; // the instance that makes it, or NoId
+  std::vector<uint8_t> shouldRebuild;
+  std::vector<std::time_t> lastWrite; // 1 until it is first needed
+
+  // Per instance
+  std::vector<uint32_t> mainOutput;
+  std::vector<uint8_t> wantToRun, somethingToDo;
+  std::vector<uint64_t> delay;
+
+  std::vector<uint32_t> inputStart, inputFile;
+  std::vector<uint8_t> inputRelation;
+  std::vector<uint32_t> outputStart, outputFile;
+  std::vector<uint32_t> userStart, userInstance;
+
+  // The shared dependency lists, by DependencyList::id, in rows as well. They only hold files no rule makes, so they
+  // never take part in invalidation; Check looks at the newest file of a list once for all the instances that use it.
+  std::vector<uint32_t> usesList; // per instance, or NoId
+  std::vector<uint32_t> listStart, listFile;
+  std::vector<std::time_t> listNewest; // 1 until it is first needed, 0 if a file in it does not exist
+
+  std::time_t Timestamp(uint32_t file);
+  std::time_t OldestOutput(uint32_t instance);
+  std::time_t ListNewest(uint32_t list);
+  uint64_t Delay(uint32_t instance);
+  // Works out whether the instance has to run, and invalidates everything after it if so
+  void Check(uint32_t instance);
+  bool CanRun(uint32_t instance);
+  void Invalidate(uint32_t instance);
+  void InvalidateFile(uint32_t file);
+  // Queues the users of the file that can run now; called with runnableM held
+  void SignalRebuilt(uint32_t file);
+};
+
+extern Graph graph;
+
+#endif
+
@@ -0,0 +1,31 @@
+#ifndef INCLUDES_H
+#define INCLUDES_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+struct File;
+struct RuleInstance;
+class FileMap;
+class FoundInputs;
+
+// One #include line: the name between the quotes or the angle brackets
+struct IncludeDirective {
+  std::string name;
+  bool quoted;
+};
+
+// Appends the #include lines of a C or C++ source. Every one is taken, also the ones inside an #if that is not taken,
+// as a dependency too many only costs a rebuild that was not needed.
+void parseIncludes(const char *data, size_t size, std::vector<IncludeDirective> &includes);
+
+// Adds the headers that the inputs of the instances include, directly or through other headers, for the instances
+// whose rule scans includes. A quoted name is looked for next to the file that includes it first, and then in the
+// include paths of the rule. Outputs of rules are found even if they do not exist yet, so that a generated header is
+// made before what includes it on the first build too. Includes that are found nowhere, such as system headers when
+// their directory is not an include path, are left out, as are the ones under an immutable prefix.
+void scanIncludes(const std::vector<RuleInstance *> &instances, FileMap &fileMap, std::vector<File *> &files, FoundInputs &found, size_t threadCount);
+
+#endif
+
@@ -0,0 +1,91 @@
+#ifndef MATCHER_H
+#define MATCHER_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include "re2/set.h"
+#include "Rule.h"
+
+struct File;
+class FileMap;
+struct RuleInstance;
+class ScanScope;
+
+// Memory for each regex set, in bytes. Set with "regex budget <megabytes>" in the Rulefile.
+extern int64_t regexBudget;
+
+// Matches files against the rules. The regexes run and the rule instances are expanded on threadCount threads, but
+// the graph is only changed on the calling thread, file by file in the order they were handed in. That makes the
+// graph the same for any number of threads.
+class Matcher {
+public:
+  Matcher(const ScanScope &scope, size_t threadCount);
+  ~Matcher();
+  void Compile(const std::vector<Rule *> &rules);
+  // Matches the files, then the files the rules created for them, until no new files turn up. Leaves files empty.
+  void Match(std::vector<File *> &files, std::vector<RuleInstance *> &instances, FileMap &fileMap);
+  size_t FilesTried() const { return tried; }
+  size_t RegexEvaluations() const { return evaluations; }
+  size_t PartitionCount() const { return partitions.size(); }
+  // How many times a regex set ran out of DFA memory, and its regexes were matched one by one instead
+  size_t DfaFallbacks() const { return fallbacks; }
+private:
+  struct Expansion {
+    Rule *rule;
+    RuleExpansion expansion;
+  };
+  // The rules that share an input regex. Most regexes are a literal path, or a literal prefix and suffix around a
+  // single wildcard; those are matched without RE2.
+  struct RuleGroup {
+    enum Kind { Literal, PrefixSuffix, Complex };
+    std::string regex;
+    std::vector<Rule *> rules;
+    Kind kind;
+    std::string prefix, suffix;
+    bool nonEmpty; // the wildcard is .+ rather than .*
+    // A rule with an inputPrefix has a group of its own, and regex is only what follows that prefix
+    bool parametric;
+  };
+  bool FullMatch(const RuleGroup &group, const std::string &path, size_t offset, const RE2::Arg *const *args, std::string *arg) const;
+  void MatchParametric(const RuleGroup &group, const std::string &path, const RE2::Arg *const *args, std::string *arg, std::vector<Expansion> &found) const;
+  void FindCandidates(const std::string &path, std::vector<int> &candidates) const;
+  void ExpandFiles();
+  void Worker();
+  const ScanScope &scope;
+  std::vector<RuleGroup> groups;
+  std::unordered_map<std::string, std::vector<int>> literalGroups;
+  // Prefix/suffix groups by the extension their suffix ends in, and the ones whose suffix has no fixed extension
+  std::unordered_map<std::string, std::vector<int>> groupsByExtension;
+  std::vector<int> groupsWithoutExtension;
+  // Parametric groups that are neither literal nor prefix/suffix; these do not go in a set, as it would match
+  // from the start of the path
+  std::vector<int> parametricGroups;
+  // The complex regexes are split over several sets, so that each set's DFA fits in the regex budget
+  struct Partition {
+    std::unique_ptr<RE2::Set> set;
+    std::vector<int> groups;
+  };
+  void AddPartition(const std::vector<int> &groups);
+  std::vector<int> complexGroups;
+  std::vector<Partition> partitions;
+  mutable std::atomic<size_t> fallbacks;
+  // The round of files being expanded; threads take the next file from it until it runs out
+  const std::vector<File *> *round;
+  std::vector<std::vector<Expansion>> results;
+  std::atomic<size_t> next, tried, evaluations;
+  std::vector<std::thread> threads;
+  std::mutex m;
+  std::condition_variable start, done;
+  size_t busy;
+  uint64_t generation;
+  bool stopping;
+};
+
+#endif
+
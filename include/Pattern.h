@@ -0,0 +1,44 @@
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include "re2/re2.h"
+
+// A rule input regex. Rules instantiated from an each block often end up with the same regex, so they share one
+// Pattern, and it is only compiled once something needs the RE2 itself. Most rules are matched without RE2 at all.
+class Pattern {
+public:
+  static std::shared_ptr<Pattern> Get(const std::string &regex);
+  explicit Pattern(const std::string &regex);
+  const std::string &Text() const { return text; }
+  const RE2 &Regex() const;
+  int CaptureCount() const { return captures; }
+private:
+  std::string text;
+  int captures;
+  mutable std::once_flag compiled;
+  mutable std::unique_ptr<RE2> regex;
+};
+
+// Room for the captures of a match, to be reused from one match to the next
+struct CaptureArgs {
+  CaptureArgs() {
+    for (size_t i = 0; i < 10; i++) {
+      argv[i] = &arg[i];
+      args[i] = &argv[i];
+    }
+  }
+  std::string arg[10];
+  RE2::Arg argv[10];
+  const RE2::Arg *args[10];
+private:
+  CaptureArgs(const CaptureArgs &);
+};
+
+// Reads the literal text of a regex from pos up to the first operator, and leaves pos there
+std::string literalRun(const std::string &regex, size_t &pos);
+
+#endif
+
@@ -3,30 +3,86 @@
 
 #include <string>
 #include <unordered_map>
-#include "re2/re2.h"
+#include "Pattern.h"
+#include "Expression.h"
 #include <vector>
+#include <mutex>
 
 struct File;
+class FileMap;
 struct RuleInstance;
 
+// What one input file makes of a rule, worked out without touching the graph so it can be done on any thread
+struct RuleExpansion {
+  RuleExpansion() : combination(0), inputsExpanded(false) {}
+  size_t combination;
+  std::vector<std::string> outputs;
+  std::vector<std::string> captures; // the ones the command uses
+  std::vector<std::string> inputs;
+  bool inputsExpanded;
+};
+
+// A variable of an each block that a rule was not copied for. The rule stands for every combination of the values of
+// its parameters.
+struct RuleParameter {
+  std::string name;
+  std::vector<std::string> values;
+  bool inInput; // used in inputPrefix
+};
+
+// Part of the literal text an input regex starts with: either fixed text, or the value of a parameter
+struct InputSegment {
+  std::string text;
+  int parameter;
+};
+
 class Rule {
 public:
   Rule(const std::string& input, const std::string &inputLine, const std::string &outputLine, const std::string &command, const std::unordered_map<std::string, std::string> &localVars) 
-  : inputMatcher(input)
+  : inputMatcher(Pattern::Get(input))
   , simpleMatcherString(input)
   , inputLine(inputLine)
   , outputLine(outputLine)
   , command(command)
   , localVars(localVars)
+  , inputs(inputLine)
+  , outputs(outputLine)
+  , commandTemplate(command)
+  , scansIncludes(false)
   {
   }
-  RE2 inputMatcher;
+  std::shared_ptr<Pattern> inputMatcher;
   std::string simpleMatcherString;
   std::string inputLine;
   std::string outputLine;
   std::string command;
   std::unordered_map<std::string, std::string> localVars;
-  void Match(File *file, std::vector<RuleInstance*> &rules, std::unordered_map<std::string, File*>& fileMap, std::vector<File *>& files, std::string*);
+  Expression inputs, outputs; // inputLine and outputLine, parsed
+  CaptureTemplate commandTemplate;
+  std::vector<RuleParameter> parameters;
+  // Parameters that are part of the input come first, and the file has to start with this text; inputMatcher then
+  // matches the rest of the path
+  std::vector<InputSegment> inputPrefix;
+  // Whether the #include lines of its inputs are followed to find their headers, and where <> ones are looked for
+  bool scansIncludes;
+  std::vector<std::string> includePaths;
+  size_t CombinationCount() const;
+  size_t ParameterValue(size_t combination, size_t parameter) const;
+  const std::unordered_map<std::string, std::string> &Variables(size_t combination) const;
+  // The full input regex for each combination of the parameters in inputPrefix
+  std::vector<std::string> InputRegexes() const;
+  // Each way the path can start with inputPrefix, as where the rest of the path starts and the combination of the
+  // values that matched. Parameters that are not in inputPrefix are left at their first value.
+  void MatchPrefix(const std::string &path, std::vector<std::pair<size_t, size_t>> &matches) const;
+  // All combinations that have the same values as this one for the parameters in inputPrefix
+  void FreeCombinations(size_t combination, std::vector<size_t> &combinations) const;
+  bool Expand(const std::string *arg, size_t combination, RuleExpansion &expansion) const;
+  void Apply(File *file, const RuleExpansion &expansion, std::vector<RuleInstance*> &rules, FileMap& fileMap, std::vector<File *>& files);
+  void Match(File *file, std::vector<RuleInstance*> &rules, FileMap& fileMap, std::vector<File *>& files, std::string*);
+private:
+  // The variables for every combination, made the first time they are needed
+  mutable std::once_flag combinationsMade;
+  mutable std::vector<std::unordered_map<std::string, std::string>> combinationVars;
 };
 
 #endif
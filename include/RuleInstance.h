@@ -6,11 +6,17 @@
 #include <unordered_set>
 #include <unordered_map>
 #include <string>
+#include <vector>
 #include <mutex>
 #include <ctime>
+#include <cstdint>
+#include "re2/set.h"
 
 class Rule;
 struct File;
+struct DependencyList;
+struct Graph;
+class DepsLog;
 
 enum Relation { None, BuildBefore, IndirectInput, Input, GeneratingInput };
 
@@ -18,32 +24,37 @@ struct RuleInstance {
   RuleInstance(Rule *rule) 
   : rule(rule)
   , mainOutput(NULL)
-  , wantToRun(false)
-  , somethingToDo(false)
+  , combination(0)
+  , dependencyList(NULL)
+  , id(0)
   , storedRv(-1)
   , runningAverageTimeTaken(0)
   , runCount(0)
-  , cachedDelay(-1)
   {
   }
-  uint64_t GetDelay() const;
+  // From an arena, like File
+  static void *operator new(size_t size);
+  static void operator delete(void *instance, size_t size);
   Rule *rule;
-  std::time_t getOldestOutput();
+  // The edges while the graph is being made; Graph::Build moves them into its rows
   std::unordered_map<File*, Relation> inputs;
   File* mainOutput;
+  size_t combination; // of the rule's parameters
   std::unordered_set<File*> outputs;
   std::unordered_set<File*> cacheOutputs;
-  std::string command;
-  bool wantToRun;
-  bool somethingToDo;
-  void Invalidate();
+  // The inputs its dependency files list that no rule makes, shared with every instance that has the same ones
+  DependencyList *dependencyList;
+  // The command is only filled in from the rule's when it is needed, as most instances never run
+  std::vector<std::string> captures;
+  std::string Command() const;
+  bool IsPseudoTarget() const;
+  uint32_t id; // in the graph
   int storedRv;
   std::chrono::nanoseconds runningAverageTimeTaken;
   size_t runCount;
-  mutable uint64_t cachedDelay;
-  bool CanRun();
   bool Run(std::mutex&);
-  void Check();
+  // Reads the outputs that match patterns into the log, after a run that wrote them, so the next run finds them there
+  void RecordDependencyFiles(const RE2::Set &patterns, const Graph &g, DepsLog &log);
 };
 
 #endif
@@ -0,0 +1,119 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <unordered_set>
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include "re2/set.h"
+
+struct File;
+struct GitIndex;
+
+// Directories changed less than this long before they were read may change again without their timestamp moving
+static const uint64_t racyMargin = 2000000000ULL;
+
+struct Directory {
+  Directory(const std::string &path, uint64_t lastWrite)
+  : path(path)
+  , lastWrite(lastWrite)
+  {
+  }
+  std::string path;
+  uint64_t lastWrite;
+};
+
+// What a directory held when it was last read from disk, by name. Symlinks are kept apart, as whether they point to a
+// file can change without the directory changing.
+struct DirectoryListing {
+  DirectoryListing() : lastWrite(0) {}
+  uint64_t lastWrite;
+  std::vector<std::string> files, dirs, links;
+};
+
+typedef std::unordered_map<std::string, DirectoryListing> DirectoryListings;
+
+// Paths the scan does not report and directories it does not descend into. Patterns come from "ignore" lines in the
+// Rulefile (regexes) and from .bobignore (gitignore-style globs); as in gitignore, the last matching pattern wins.
+class IgnoreList {
+public:
+  IgnoreList();
+  void Add(const std::string &regex, bool negated, bool directoryOnly);
+  void AddGlob(const std::string &glob);
+  void Compile();
+  bool IsIgnored(const std::string &path, bool isDirectory) const;
+private:
+  struct Pattern {
+    bool negated;
+    bool directoryOnly;
+  };
+  RE2::Set set;
+  std::vector<Pattern> patterns;
+};
+
+extern IgnoreList ignores;
+
+// The part of the tree any rule could match, derived from the literal text each input regex starts with. Rules like
+// "src/(.*)\.cpp" only ever need "src" to be scanned; a rule that starts with a wildcard makes everything relevant.
+class ScanScope {
+public:
+  ScanScope() : everything(false) {}
+  void Add(const std::string &regex);
+  bool Everything() const { return everything; }
+  // Whether a directory should be read, given that its parent is not covered. Sets covered if everything below it is relevant.
+  bool IsRelevantDirectory(const std::string &dir, bool &covered) const;
+  // Whether a file in a directory that is not covered is relevant
+  bool IsRelevantFile(const std::string &path) const;
+  // Whether any rule could match the path
+  bool Covers(const std::string &path) const;
+  void Directories(std::vector<std::string> &dirs) const;
+  // The files that rules name literally
+  void Files(std::vector<std::string> &paths) const;
+private:
+  bool everything;
+  std::unordered_set<std::string> subtrees, ancestors, files;
+};
+
+extern ScanScope scanScope;
+extern bool useGitIndex;
+
+std::string literalPrefix(const std::string &regex, bool &isLiteral);
+void readIgnoreFile(const std::string &path, uint64_t &hash);
+std::string globToRegex(const std::string &glob);
+
+// Batches of files handed from the scanning threads to the thread that matches them. Push blocks while maxBatches
+// batches are waiting, so the scan cannot run arbitrarily far ahead; 0 means there is no limit.
+class FileQueue {
+public:
+  FileQueue(size_t maxBatches) : maxBatches(maxBatches), closed(false) {}
+  void Push(std::vector<File *> &&batch);
+  // Returns false once the queue is closed and everything in it has been taken out
+  bool Pop(std::vector<File *> &batch);
+  void Close();
+private:
+  size_t maxBatches;
+  bool closed;
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<std::vector<File *>> batches;
+};
+
+// Same as getFiles, but hands the files to the queue as they are found and closes it when done
+size_t scanFiles(FileQueue &queue, std::vector<Directory> &dirs, size_t threadCount, const ScanScope &scope, const IgnoreList &ignores, const GitIndex *index, DirectoryListings *listings);
+
+// Finds all regular files below the current directory that are in scope and not ignored, using up to threadCount
+// threads. Every directory that was read is added to dirs together with its modification time. With a git index,
+// directories that did not change since it was written are listed from the index instead of read from disk. With
+// listings from a previous run, directories whose timestamp did not change are listed from those, before trying the
+// index; the listings of directories that are read from disk are added to them, and the ones of directories that were
+// not visited are removed. Returns how many were read from disk.
+size_t getFiles(std::vector<File *> &files, std::vector<Directory> &dirs, size_t threadCount, const ScanScope &scope, const IgnoreList &ignores, const GitIndex *index, DirectoryListings *listings);
+uint64_t lastWriteStamp(const std::string &path);
+
+#endif
+
@@ -0,0 +1,94 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include "Scan.h"
+#include "Depfile.h"
+#include "Includes.h"
+#include <mutex>
+
+class Rule;
+struct File;
+class FileMap;
+struct RuleInstance;
+
+// The snapshot holds the graph as it is right after matching the rules, before any dependency files are loaded.
+// It is only valid for the exact same rule files and the exact same set of files on disk; the latter is checked
+// by comparing the modification time of every directory that was scanned to build it.
+// Creates those of bob's own files in the build root that do not exist yet. From then on they are only written in
+// place, which leaves the build root's timestamp alone, so that writing them does not make the next snapshot stale.
+void createStateFiles();
+
+bool LoadSnapshot(const std::string &fileName, uint64_t ruleHash, std::vector<Rule *> &rules, FileMap &fileMap, std::vector<RuleInstance *> &instances);
+void StoreSnapshot(const std::string &fileName, uint64_t ruleHash, uint64_t scanStart, const std::vector<Directory> &dirs, const std::vector<Rule *> &rules, const FileMap &fileMap, const std::vector<RuleInstance *> &instances);
+
+// The directory listings of the previous scan, so that the next one only needs to read directories that changed
+bool LoadDirectoryListings(const std::string &fileName, DirectoryListings &listings);
+void StoreDirectoryListings(const std::string &fileName, const DirectoryListings &listings);
+
+// What a dependency file said when it was last read, and its modification time then
+struct DepfileEntry {
+  uint64_t lastWrite;
+  // Each rule as the number of its target in the log, followed by those of its inputs
+  std::vector<std::vector<uint32_t>> rules;
+};
+
+// The dependency files read so far, kept in one log file that records are appended to, so that a run only parses
+// the ones that changed since. Paths are written once and then referred to by their number in the log.
+class DepsLog {
+public:
+  DepsLog() : records(0), rewrite(true) {}
+  // Reads the whole log; later records for a dependency file replace earlier ones
+  void Load(const std::string &fileName);
+  // Find and Path are not safe to call while Record runs on another thread
+  const DepfileEntry *Find(const std::string &depfile) const;
+  const std::string &Path(uint32_t id) const { return paths[id]; }
+  size_t PathCount() const { return paths.size(); }
+  const DepfileEntry &Record(const std::string &depfile, uint64_t lastWrite, const std::vector<DepfileRule> &rules);
+  // Appends what was recorded since the last flush, or writes the log anew when most of it is out of date
+  void Flush();
+private:
+  // Writes a record for the path to out if it is new
+  uint32_t PathId(const std::string &path, std::string &out);
+  std::mutex m;
+  std::string fileName;
+  std::unordered_map<std::string, DepfileEntry> entries;
+  std::vector<std::string> paths;
+  std::unordered_map<std::string, uint32_t> pathIds;
+  std::string pending;
+  size_t records; // in the log file, including the ones that were replaced
+  bool rewrite;
+};
+
+extern DepsLog depsLog;
+
+// The #include lines of the sources the include scanner read, by a hash of their content, and the content each path
+// had when it was read, so that files that did not change are not read again and ones that were only touched, or
+// that are copies of one another, are not parsed again.
+class IncludeCache {
+public:
+  IncludeCache() : changed(false) {}
+  void Load(const std::string &fileName);
+  // The includes of the file, read again if it changed, or NULL if it cannot be read; safe to call on several threads
+  const std::vector<IncludeDirective> *Includes(const std::string &path);
+  // Writes the cache if anything was read, leaving out the content no path has anymore
+  void Store();
+private:
+  struct PathEntry {
+    uint64_t lastWrite;
+    uint64_t hash;
+  };
+  std::mutex m;
+  std::string fileName;
+  std::unordered_map<std::string, PathEntry> paths;
+  std::unordered_map<uint64_t, std::vector<IncludeDirective>> contents;
+  bool changed;
+};
+
+extern IncludeCache includeCache;
+
+#endif
+
@@ -0,0 +1,393 @@
+#include "Depfile.h"
+#include "File.h"
+#include "Funcs.h"
+#include "Graph.h"
+#include "Includes.h"
+#include "Rule.h"
+#include "RuleInstance.h"
+#include "Test.h"
+#include "Scan.h"
+#include "Snapshot.h"
+#include "re2/set.h"
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <thread>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+enum CharClass { Plain, Space, Newline, Backslash, Colon, Dollar, Hash };
+
+// So that the runs of plain path characters, which is nearly all of a dependency file, take one lookup per byte
+struct CharClasses {
+  unsigned char of[256];
+  CharClasses() {
+    memset(of, Plain, sizeof(of));
+    of[(unsigned char)' '] = of[(unsigned char)'\t'] = of[(unsigned char)'\r'] = Space;
+    of[(unsigned char)'\n'] = Newline;
+    of[(unsigned char)'\\'] = Backslash;
+    of[(unsigned char)':'] = Colon;
+    of[(unsigned char)'$'] = Dollar;
+    of[(unsigned char)'#'] = Hash;
+  }
+};
+
+const CharClasses classes;
+
+struct LineParser {
+  LineParser(std::vector<DepfileRule> &rules) : rules(rules), afterColon(false) {}
+  void EndWord() {
+    if (word.empty()) return;
+    (afterColon ? inputs : targets).push_back(word);
+    word.clear();
+  }
+  void EndLine() {
+    EndWord();
+    if (afterColon) {
+      for (auto &target : targets) {
+        rules.push_back(DepfileRule());
+        rules.back().target.swap(target);
+        rules.back().inputs = inputs;
+      }
+    }
+    targets.clear();
+    inputs.clear();
+    afterColon = false;
+  }
+  std::vector<DepfileRule> &rules;
+  std::string word;
+  std::vector<std::string> targets, inputs;
+  bool afterColon;
+};
+
+}
+
+void parseDepfile(const char *data, size_t size, std::vector<DepfileRule> &rules) {
+  const char *p = data, *end = data + size;
+  LineParser line(rules);
+  while (p != end) {
+    const char *run = p;
+    while (p != end && classes.of[(unsigned char)*p] == Plain) p++;
+    line.word.append(run, p);
+    if (p == end) break;
+    char c = *p++;
+    switch (classes.of[(unsigned char)c]) {
+    case Space:
+      line.EndWord();
+      break;
+    case Newline:
+      line.EndLine();
+      break;
+    case Backslash:
+      if (p != end && (*p == ' ' || *p == '#')) {
+        line.word += *p++;
+      } else if (p != end && *p == '\n') {
+        p++;
+        line.EndWord();
+      } else if (end - p >= 2 && p[0] == '\r' && p[1] == '\n') {
+        p += 2;
+        line.EndWord();
+      } else {
+        line.word += c;
+      }
+      break;
+    case Colon:
+      if (line.afterColon || (line.word.size() == 1 && isalpha((unsigned char)line.word[0]) && p != end && (*p == '\\' || *p == '/'))) {
+        line.word += c;
+      } else {
+        line.EndWord();
+        line.afterColon = true;
+      }
+      break;
+    case Dollar:
+      if (p != end && *p == '$') p++;
+      line.word += c;
+      break;
+    case Hash: {
+      const char *newline = (const char *)memchr(p, '\n', end - p);
+      p = newline ? newline : end;
+      break;
+    }
+    }
+  }
+  line.EndLine();
+}
+
+bool readDepfile(const std::string &path, std::vector<DepfileRule> &rules, std::vector<char> &buffer) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return false;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return true;
+  }
+  // Mapping costs more than reading for the few kilobytes most of them have
+  if (st.st_size < 65536) {
+    buffer.resize(st.st_size);
+    size_t got = 0;
+    while (got < buffer.size()) {
+      ssize_t n = read(fd, &buffer[got], buffer.size() - got);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      got += n;
+    }
+    close(fd);
+    // Cut short while it was being written
+    if (got != buffer.size()) return false;
+    parseDepfile(buffer.data(), got, rules);
+    return true;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+  parseDepfile((const char *)map, st.st_size, rules);
+  munmap(map, st.st_size);
+  return true;
+}
+
+DependencyLists dependencyLists;
+
+DependencyLists::~DependencyLists() {
+  for (DependencyList *list : lists) delete list;
+}
+
+DependencyList *DependencyLists::Intern(std::vector<File *> &files) {
+  std::sort(files.begin(), files.end());
+  files.erase(std::unique(files.begin(), files.end()), files.end());
+  uint64_t hash = 14695981039346656037ULL;
+  for (File *f : files) {
+    hash = (hash ^ (uintptr_t)f) * 1099511628211ULL;
+  }
+  std::vector<DependencyList *> &same = byHash[hash];
+  for (DependencyList *list : same) {
+    if (list->files == files) return list;
+  }
+  DependencyList *list = new DependencyList;
+  list->id = lists.size();
+  list->files.swap(files);
+  for (File *f : list->files) f->lists.push_back(list);
+  lists.push_back(list);
+  same.push_back(list);
+  return list;
+}
+
+bool isImmutable(const std::string &path) {
+  for (const auto &prefix : immutables) {
+    if (path.compare(0, prefix.size(), prefix) == 0) return true;
+  }
+  return false;
+}
+
+bool FoundInputs::IsMade(const File *input) {
+  return input->generatingRule || generateds.Match(input->path, NULL);
+}
+
+void FoundInputs::Add(RuleInstance *ri, File *input, bool made) {
+  if (made) {
+    Relation &relation = ri->inputs[input];
+    if (relation == None) {
+      relation = IndirectInput;
+      input->dependencies.push_back(ri);
+    }
+    return;
+  }
+  // The inputs of one instance mostly come one after the other
+  if (ri != last) {
+    auto it = shared.find(ri);
+    if (it == shared.end()) {
+      sharing.push_back(ri);
+      it = shared.insert(std::make_pair(ri, std::vector<File *>())).first;
+    }
+    last = ri;
+    lastShared = &it->second;
+  }
+  lastShared->push_back(input);
+}
+
+void FoundInputs::Commit() {
+  for (RuleInstance *ri : sharing) {
+    std::vector<File *> &list = shared[ri];
+    if (ri->dependencyList) {
+      list.insert(list.end(), ri->dependencyList->files.begin(), ri->dependencyList->files.end());
+      std::vector<RuleInstance *> &users = ri->dependencyList->users;
+      users.erase(std::find(users.begin(), users.end(), ri));
+    }
+    // Inputs the instance has anyway, such as its source file, would only be looked at twice. There are only a few.
+    std::sort(list.begin(), list.end());
+    list.erase(std::unique(list.begin(), list.end()), list.end());
+    for (const auto &in : ri->inputs) {
+      auto it = std::lower_bound(list.begin(), list.end(), in.first);
+      if (it != list.end() && *it == in.first) list.erase(it);
+    }
+    if (list.empty()) {
+      ri->dependencyList = NULL;
+      continue;
+    }
+    ri->dependencyList = dependencyLists.Intern(list);
+    ri->dependencyList->users.push_back(ri);
+  }
+  sharing.clear();
+  shared.clear();
+  last = NULL;
+}
+
+void loadDependencies(const std::vector<File *> &candidates, FileMap &fileMap, std::vector<File *> &files, FoundInputs &found, size_t threadCount) {
+  std::vector<const DepfileEntry *> logged(candidates.size());
+  std::vector<std::vector<DepfileRule>> parsed(candidates.size());
+  std::vector<uint64_t> reread(candidates.size()); // the time of the ones that were parsed again
+  std::atomic<size_t> next(0);
+  auto worker = [&] {
+    std::vector<int> m;
+    std::vector<char> buffer;
+    static const size_t chunk = 64;
+    for (size_t start = next.fetch_add(chunk); start < candidates.size(); start = next.fetch_add(chunk)) {
+      for (size_t i = start; i < std::min(start + chunk, candidates.size()); i++) {
+        const std::string &path = candidates[i]->path;
+        if (!depfiles.Match(path, &m)) continue;
+        uint64_t lastWrite = lastWriteStamp(path);
+        if (!lastWrite) continue;
+        const DepfileEntry *entry = depsLog.Find(path);
+        if (entry && entry->lastWrite == lastWrite) {
+          logged[i] = entry;
+        } else if (readDepfile(path, parsed[i], buffer)) {
+          reread[i] = lastWrite;
+        }
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < threadCount; i++) threads.push_back(std::thread(worker));
+  worker();
+  for (auto &t : threads) t.join();
+
+  // Each path in the log is looked up once, however many dependency files list it
+  enum InputKind { Unknown, Skipped, Shared, Made };
+  std::vector<File *> pathFiles;
+  std::vector<uint8_t> pathKinds;
+  for (size_t i = 0; i < candidates.size(); i++) {
+    if (reread[i]) logged[i] = &depsLog.Record(candidates[i]->path, reread[i], parsed[i]);
+    if (!logged[i]) continue;
+    pathFiles.resize(depsLog.PathCount());
+    pathKinds.resize(depsLog.PathCount(), Unknown);
+    for (const auto &rule : logged[i]->rules) {
+      File *&f = pathFiles[rule[0]];
+      if (!f) f = create_file(depsLog.Path(rule[0]), fileMap, files);
+      if (!f->generatingRule) continue;
+      for (size_t n = 1; n < rule.size(); n++) {
+        uint8_t &kind = pathKinds[rule[n]];
+        if (kind == Unknown) kind = isImmutable(depsLog.Path(rule[n])) ? Skipped : Shared;
+        if (kind == Skipped) continue;
+        File *&depfile = pathFiles[rule[n]];
+        if (!depfile) {
+          depfile = create_file(depsLog.Path(rule[n]), fileMap, files);
+          if (FoundInputs::IsMade(depfile)) kind = Made;
+        }
+        found.Add(f->generatingRule, depfile, kind == Made);
+      }
+    }
+  }
+}
+
+void loadReachableDependencies(const std::vector<RuleInstance *> &roots, FileMap &fileMap, std::vector<File *> &files, size_t threadCount) {
+  // A compiler writes a dependency file next to what it was asked for (as with -MMD) whether or not the rule names it
+  // as an output. Nothing says which instance those belong to until they are read, so they are all read up front.
+  std::vector<File *> undeclared;
+  for (File *f : fileMap) {
+    if (!f->generatingRule) undeclared.push_back(f);
+  }
+  std::unordered_set<RuleInstance *> loaded;
+  for (;;) {
+    std::unordered_set<RuleInstance *> reached(roots.begin(), roots.end());
+    std::vector<RuleInstance *> toVisit(roots.begin(), roots.end());
+    std::vector<File *> candidates;
+    candidates.swap(undeclared);
+    std::vector<RuleInstance *> toScan;
+    while (!toVisit.empty()) {
+      RuleInstance *ri = toVisit.back();
+      toVisit.pop_back();
+      if (loaded.insert(ri).second) {
+        candidates.insert(candidates.end(), ri->outputs.begin(), ri->outputs.end());
+        candidates.insert(candidates.end(), ri->cacheOutputs.begin(), ri->cacheOutputs.end());
+        if (ri->rule->scansIncludes) toScan.push_back(ri);
+      }
+      for (const auto &in : ri->inputs) {
+        RuleInstance *generator = in.first->generatingRule;
+        if (generator && reached.insert(generator).second) toVisit.push_back(generator);
+      }
+    }
+    if (candidates.empty()) break;
+    FoundInputs found;
+    loadDependencies(candidates, fileMap, files, found, threadCount);
+    scanIncludes(toScan, fileMap, files, found, threadCount);
+    found.Commit();
+  }
+}
+
+static std::string describe(const std::vector<DepfileRule> &rules) {
+  std::string out;
+  for (const auto &rule : rules) {
+    out += "[" + rule.target + "]";
+    for (const auto &input : rule.inputs) out += " [" + input + "]";
+    out += "\n";
+  }
+  return out;
+}
+
+TEST(depfilesHandleEscapesAndContinuations) {
+  const char text[] =
+    "obj/a.o obj/a.d: src/a.c \\\n"
+    "  include/my\\ header.h include/\\#1.h \\\r\n"
+    "  gen/$$x.h # a comment: not.h\n"
+    "\n"
+    "C:\\src\\b.o: C:\\src\\b.c\n"
+    "include/my\\ header.h:\n";
+  std::vector<DepfileRule> rules;
+  parseDepfile(text, sizeof(text) - 1, rules);
+  ASSERT_STREQ(describe(rules),
+    "[obj/a.o] [src/a.c] [include/my header.h] [include/#1.h] [gen/$x.h]\n"
+    "[obj/a.d] [src/a.c] [include/my header.h] [include/#1.h] [gen/$x.h]\n"
+    "[C:\\src\\b.o] [C:\\src\\b.c]\n"
+    "[include/my header.h]\n");
+}
+
+TEST(dependencyListsAreSharedAndCheckedOnce) {
+  FileMap fileMap;
+  std::vector<File *> files;
+  File *a = create_file("a.h", fileMap, files);
+  File *b = create_file("b.h", fileMap, files);
+  DependencyLists lists;
+  std::vector<File *> first = { b, a, b }, second = { a, b }, other = { a };
+  DependencyList *list = lists.Intern(first);
+  bool same = lists.Intern(second) == list && lists.Intern(other) != list;
+  ASSERT_EQ(same, true);
+  ASSERT_EQ(list->files.size(), 2);
+  ASSERT_EQ(a->lists.size(), 2);
+
+  Rule compileRule(".*\\.c", "", "", "cc", std::unordered_map<std::string, std::string>());
+  RuleInstance *compile = new RuleInstance(&compileRule);
+  compile->mainOutput = create_file("a.o", fileMap, files);
+  compile->dependencyList = list;
+  std::vector<RuleInstance *> instances = { compile };
+  Graph g;
+  g.Build(instances, fileMap, lists);
+  ASSERT_EQ(g.usesList[compile->id], list->id);
+  ASSERT_EQ(g.listStart[list->id + 1] - g.listStart[list->id], 2);
+  bool missing = g.ListNewest(list->id) == 0;
+  ASSERT_EQ(missing, true);
+
+  delete compile;
+  for (File *f : files) delete f;
+}
+
@@ -0,0 +1,333 @@
+#include "Expression.h"
+#include "Funcs.h"
+#include "Test.h"
+#include <algorithm>
+
+static std::mutex expressionsM;
+static std::unordered_map<std::string, std::shared_ptr<const Expression>> expressions;
+
+// The patterns of functions are kept for the whole run. There are few different ones, and each is used for many rules
+// and many items.
+static std::mutex functionPatternsM;
+static std::unordered_map<std::string, std::shared_ptr<Pattern>> functionPatterns;
+
+static std::shared_ptr<Pattern> functionPattern(const std::string &text) {
+  std::lock_guard<std::mutex> lock(functionPatternsM);
+  std::shared_ptr<Pattern> &p = functionPatterns[text];
+  if (!p) p = Pattern::Get(text);
+  return p;
+}
+
+CaptureTemplate::CaptureTemplate(const std::string &text)
+: text(text)
+{
+  size_t start = 0;
+  for (size_t i = 0; i + 1 < text.size(); i++) {
+    if (text[i] == '\\' && text[i + 1] >= '1' && text[i + 1] <= '9') {
+      Piece p;
+      p.text = text.substr(start, i - start);
+      p.capture = text[i + 1] - '1';
+      pieces.push_back(p);
+      start = i + 2;
+      i++;
+    }
+  }
+  tail = text.substr(start);
+}
+
+size_t CaptureTemplate::CapturesUsed() const {
+  size_t used = 0;
+  for (const Piece &p : pieces) used = std::max(used, p.capture + 1);
+  return used;
+}
+
+void CaptureTemplate::Fill(std::string &out, const std::string *captures, size_t captureCount) const {
+  if (pieces.empty()) {
+    out += text;
+    return;
+  }
+  for (const Piece &p : pieces) {
+    out += p.text;
+    if (captures && p.capture < captureCount) {
+      out += captures[p.capture];
+    } else {
+      out += '\\';
+      out += (char)('1' + p.capture);
+    }
+  }
+  out += tail;
+}
+
+std::shared_ptr<const Expression> Expression::Get(const std::string &text) {
+  std::lock_guard<std::mutex> lock(expressionsM);
+  std::shared_ptr<const Expression> &e = expressions[text];
+  if (!e) e = std::make_shared<Expression>(text);
+  return e;
+}
+
+Expression::Expression(const std::string &text)
+: text(text)
+, error(Ok)
+{
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t start = text.find("$(", pos);
+    if (start != pos) {
+      Node n;
+      n.kind = Node::Text;
+      n.text = CaptureTemplate(text.substr(pos, start - pos));
+      nodes.push_back(n);
+    }
+    if (start == text.npos) break;
+
+    size_t end = find_end_brace_balanced(text, start + 2);
+    if (end == text.npos) {
+      printf("No closing brace found in %s\n", text.c_str());
+      error = UnclosedBrace;
+      return;
+    }
+    std::string inner = text.substr(start + 2, end - start - 3);
+    size_t space = find_first_owned_space(inner);
+    Node n;
+    if (space == inner.npos || inner.find_first_not_of(' ', space) == inner.npos) {
+      n.kind = Node::Variable;
+      n.argument = std::make_shared<Expression>(inner);
+    } else {
+      std::string function = inner.substr(0, space), args = inner.substr(space + 1);
+      if (function == "sub") n.kind = Node::Sub;
+      else if (function == "filter") n.kind = Node::Filter;
+      else if (function == "subst") n.kind = Node::Subst;
+      else if (function == "rep_subst") n.kind = Node::RepSubst;
+      else {
+        printf("Unknown function: %s\n", function.c_str());
+        error = UnknownFunction;
+        return;
+      }
+      // The pattern, and the replacement for all but filter, are everything up to the next comma
+      size_t first = args.find(','), last = (n.kind == Node::Filter || first == args.npos ? first : args.find(',', first + 1));
+      if (last == args.npos) {
+        printf("Missing argument to %s in %s\n", function.c_str(), text.c_str());
+        error = MissingArgument;
+        return;
+      }
+      n.pattern = CaptureTemplate(args.substr(0, first));
+      if (!n.pattern.UsesCaptures()) n.compiled = functionPattern(n.pattern.Text());
+      if (n.kind != Node::Filter) n.target = CaptureTemplate(args.substr(first + 1, last - first - 1));
+      n.argument = std::make_shared<Expression>(args.substr(last + 1));
+    }
+    if (n.argument->error != Ok) {
+      error = n.argument->error;
+      return;
+    }
+    nodes.push_back(n);
+    pos = end;
+  }
+}
+
+// What one item of a rep_subst is replaced by. Ones that only use global variables are the same for every rule, and
+// are kept for the rest of the run.
+static std::mutex substExpansionsM;
+static std::unordered_map<std::string, std::shared_ptr<const std::vector<std::string>>> substExpansions;
+
+// Deeper than this, the replacements probably keep producing new items, like $(rep_subst (.*),@1x,a) does
+static const size_t maxClosureDepth = 500;
+
+Expression::Error Expression::Evaluate(const std::unordered_map<std::string, std::string> &instancedVars, std::string &out, const std::string *captures, size_t captureCount) const {
+  bool instanced = false;
+  return Evaluate(instancedVars, out, captures, captureCount, instanced);
+}
+
+Expression::Error Expression::Evaluate(const std::unordered_map<std::string, std::string> &instancedVars, std::string &out, const std::string *captures, size_t captureCount, bool &instanced) const {
+  if (error != Ok) return error;
+  for (const Node &n : nodes) {
+    if (n.kind == Node::Text) {
+      n.text.Fill(out, captures, captureCount);
+      continue;
+    }
+
+    Error e;
+    if (n.kind == Node::Variable) {
+      std::string name;
+      if ((e = n.argument->Evaluate(instancedVars, name, captures, captureCount, instanced)) != Ok) return e;
+      auto local = instancedVars.find(name);
+      auto global = vars.find(name);
+      const std::string *value;
+      if (local != instancedVars.end()) {
+        value = &local->second;
+        instanced = true;
+      } else if (global != vars.end()) {
+        value = &global->second;
+      } else {
+        printf("Used variable that's not defined: %s\n", name.c_str());
+        printf("      in fixing up %s\n", text.c_str());
+        return UndefinedVariable;
+      }
+      // Values are expressions too, but most are plain text
+      if (value->find("$(") == value->npos) {
+        out += *value;
+      } else if ((e = Get(*value)->Evaluate(instancedVars, out, NULL, 0, instanced)) != Ok) {
+        return e;
+      }
+      continue;
+    }
+
+    std::string target, data;
+    n.target.Fill(target, captures, captureCount);
+    if ((e = n.argument->Evaluate(instancedVars, data, captures, captureCount, instanced)) != Ok) return e;
+    std::shared_ptr<Pattern> pattern = n.compiled;
+    if (!pattern) {
+      std::string patternText;
+      n.pattern.Fill(patternText, captures, captureCount);
+      pattern = functionPattern(patternText);
+    }
+    CaptureArgs matched;
+    if (n.kind == Node::Sub) {
+      while (RE2::Replace(&data, pattern->Regex(), target)) { }
+      out += data;
+    } else if (n.kind == Node::Filter) {
+      for (const auto &item : split(data, ' ')) {
+        if (!RE2::FullMatch(item, pattern->Regex()))
+          out += " " + item;
+      }
+    } else if (n.kind == Node::Subst) {
+      for (const auto &item : split(data, ' ')) {
+        std::string repl = replace_with_pattern(item, *pattern, target, matched);
+        // The replacement may name variables after what it matched
+        std::string expanded;
+        if (repl.find("$(") == repl.npos) {
+          swap(expanded, repl);
+        } else if ((e = Get(repl)->Evaluate(instancedVars, expanded, NULL, 0, instanced)) != Ok) {
+          return e;
+        }
+        for (const auto &i : split(expanded, ' ')) {
+          out += i + " ";
+        }
+      }
+    } else {
+      // Every item is replaced by what it expands to, until only items that expand to themselves are left. The result
+      // is what repeating the replacement on the whole list would settle on, with each item kept at its last place,
+      // so that everything an item leads to comes after it. That is a depth-first walk over the items in reverse,
+      // which expands each item once.
+      struct Step {
+        std::string item;
+        std::shared_ptr<const std::vector<std::string>> expansion;
+        size_t remaining;
+      };
+      std::vector<Step> stack;
+      std::unordered_set<std::string> visited, emitted;
+      std::vector<std::string> reversed;
+      Step root;
+      root.expansion = std::make_shared<std::vector<std::string>>(split(data, ' '));
+      root.remaining = root.expansion->size();
+      stack.push_back(root);
+      std::string keyPrefix = pattern->Text() + '\0' + target + '\0';
+      while (!stack.empty()) {
+        Step &step = stack.back();
+        if (step.remaining == 0) {
+          stack.pop_back();
+          continue;
+        }
+        std::string item = (*step.expansion)[--step.remaining];
+        if ((stack.size() > 1 && item == step.item) || stack.size() > maxClosureDepth) {
+          if (emitted.insert(item).second) reversed.push_back(item);
+          continue;
+        }
+        if (!visited.insert(item).second) continue;
+
+        std::shared_ptr<const std::vector<std::string>> expansion;
+        std::string key = keyPrefix + item;
+        {
+          std::lock_guard<std::mutex> lock(substExpansionsM);
+          auto known = substExpansions.find(key);
+          if (known != substExpansions.end()) expansion = known->second;
+        }
+        if (!expansion) {
+          std::string repl = replace_with_pattern(item, *pattern, target, matched), expanded;
+          bool itemInstanced = false;
+          if (repl.find("$(") == repl.npos) {
+            swap(expanded, repl);
+          } else if ((e = Get(repl)->Evaluate(instancedVars, expanded, NULL, 0, itemInstanced)) != Ok) {
+            return e;
+          }
+          expansion = std::make_shared<std::vector<std::string>>(split(expanded, ' '));
+          if (itemInstanced) {
+            instanced = true;
+          } else {
+            std::lock_guard<std::mutex> lock(substExpansionsM);
+            substExpansions[key] = expansion;
+          }
+        }
+        Step next;
+        next.item = item;
+        next.expansion = expansion;
+        next.remaining = expansion->size();
+        stack.push_back(next);
+      }
+      for (size_t i = reversed.size(); i--;) {
+        out += reversed[i] + " ";
+      }
+    }
+  }
+  return Ok;
+}
+
+static std::string evaluate(const std::string &text, const std::unordered_map<std::string, std::string> &instancedVars, Expression::Error expected = Expression::Ok) {
+  std::string out;
+  if (Expression(text).Evaluate(instancedVars, out) != expected) return "<unexpected result>";
+  return out;
+}
+
+TEST(expressionsExpandNestedVariables) {
+  std::unordered_map<std::string, std::string> instanced = { { "BT", "Debug" }, { "FLAGS-Debug", "-g $(OPT)" }, { "OPT", "-O0" } };
+  ASSERT_STREQ(evaluate("cc $(FLAGS-$(BT)) -o out/$(BT)/x", instanced), "cc -g -O0 -o out/Debug/x");
+  ASSERT_STREQ(evaluate("no variables", instanced), "no variables");
+  ASSERT_STREQ(evaluate("$(MISSING) x", instanced, Expression::UndefinedVariable), "");
+  ASSERT_STREQ(evaluate("$(BT", instanced, Expression::UnclosedBrace), "");
+  ASSERT_STREQ(evaluate("$(frobnicate a,b,c)", instanced, Expression::UnknownFunction), "");
+}
+
+TEST(expressionFunctionsWorkOnTheirLastArgument) {
+  std::unordered_map<std::string, std::string> instanced = { { "FILES", "a.cpp b_linux.cpp c_win.cpp" }, { "a_DEPS", "b" }, { "b_DEPS", "c" }, { "c_DEPS", "" } };
+  ASSERT_STREQ(evaluate("$(filter .*_win\\.cpp,$(FILES))", instanced), " a.cpp b_linux.cpp");
+  ASSERT_STREQ(evaluate("$(subst (.*)\\.cpp,@1.o,$(FILES))", instanced), "a.o b_linux.o c_win.o ");
+  ASSERT_STREQ(evaluate("$(sub _[a-z]*,,$(FILES))", instanced), "a.cpp b.cpp c.cpp");
+  ASSERT_STREQ(evaluate("$(rep_subst (.*),@1 $(@1_DEPS),a)", instanced), "a b c ");
+}
+
+TEST(expressionsSubstituteCaptures) {
+  std::unordered_map<std::string, std::string> instanced = { { "dir", "obj" } };
+  std::string captures[] = { "src/main", "two" };
+  std::string out;
+  Expression::Error e = Expression("$(dir)/\\1.o \\2 \\3 \\\\1 $(subst (.*),\\1/@1,a)").Evaluate(instanced, out, captures, 2);
+  ASSERT_EQ(e, Expression::Ok);
+  ASSERT_STREQ(out, "obj/src/main.o two \\3 \\src/main src/main/a ");
+}
+
+TEST(functionPatternsAreCompiledOnce) {
+  std::unordered_map<std::string, std::string> instanced = { { "FILES", "a.c b.c" } };
+  std::string first = evaluate("$(subst (.*)\\.c,@1.o,$(FILES))", instanced);
+  std::shared_ptr<Pattern> a = functionPattern("(.*)\\.c");
+  std::string second = evaluate("x $(filter (.*)\\.c,$(FILES) d.h)", instanced);
+  std::shared_ptr<Pattern> b = functionPattern("(.*)\\.c");
+  bool shared = (a.get() == b.get());
+  ASSERT_EQ(shared, true);
+  ASSERT_STREQ(first, "a.o b.o ");
+  ASSERT_STREQ(second, "x  d.h");
+}
+
+TEST(repSubstPutsEverythingAfterWhatLeadsToIt) {
+  std::unordered_map<std::string, std::string> instanced = { { "app_DEPS", "net ui" }, { "net_DEPS", "base" }, { "ui_DEPS", "base gfx" }, { "gfx_DEPS", "base" },
+                                                             { "base_DEPS", "" }, { "x_DEPS", "y" }, { "y_DEPS", "x" } };
+  ASSERT_STREQ(evaluate("$(rep_subst (.*),@1 $(@1_DEPS),app)", instanced), "app net ui gfx base ");
+  ASSERT_STREQ(evaluate("$(rep_subst (.*),@1 $(@1_DEPS),gfx app)", instanced), "app net ui gfx base ");
+  ASSERT_STREQ(evaluate("$(rep_subst (.*),$(@1_DEPS),app)", instanced), "");
+  ASSERT_STREQ(evaluate("$(rep_subst (.*),@1 $(@1_DEPS),x)", instanced), "x y ");
+  // A long chain is walked once, rather than once per link
+  std::unordered_map<std::string, std::string> chain;
+  std::string expected;
+  for (int n = 0; n < 400; n++) {
+    chain["m" + std::to_string(n) + "_DEPS"] = (n == 399 ? "" : "m" + std::to_string(n + 1));
+    expected += "m" + std::to_string(n) + " ";
+  }
+  ASSERT_STREQ(evaluate("$(rep_subst (.*),@1 $(@1_DEPS),m0)", chain), expected);
+}
@@ -4,43 +4,263 @@
 #include "Funcs.h"
 #include "re2/set.h"
 #include "RuleInstance.h"
+#include "Scan.h"
+#include "Matcher.h"
+#include "Arena.h"
+#include "Depfile.h"
+#include "Test.h"
 
-File* create_file(const std::string &fileName, std::unordered_map<std::string, File*> &fileMap, std::vector<File *>& files) {
-  File *&file = fileMap[fileName];
+File* create_file(const std::string &fileName, FileMap &fileMap, std::vector<File *>& files) {
+  File *file = fileMap.Find(fileName);
   if (!file) {
     file = new File(fileName);
+    fileMap.Insert(file);
     files.push_back(file);
   }
   return file;
 }
 
-static void instantiateRule(const std::string &inputRegex, const std::string &inputLine, const std::string &outputLine, const std::string &buffer, std::unordered_map<std::string, std::string> &localVars, const std::vector<std::pair<std::string, std::vector<std::string>>> &args, std::vector<Rule *> &rules) {
+RuleInstance *File::FirstUser() const {
+  if (!dependencies.empty()) return dependencies[0];
+  for (const DependencyList *list : lists) {
+    if (!list->users.empty()) return list->users[0];
+  }
+  return NULL;
+}
+
+FileMap::FileMap(size_t expected)
+: count(0)
+, used(0)
+{
+  Reserve(expected);
+}
+
+uint64_t FileMap::Hash(const re2::StringPiece &path) {
+  uint64_t hash = hash_bytes(path.data(), path.size());
+  return hash < liveHash ? hash + liveHash : hash;
+}
+
+File *FileMap::Find(const re2::StringPiece &path) const {
+  if (slots.empty()) return NULL;
+  uint64_t hash = Hash(path);
+  size_t mask = slots.size() - 1;
+  for (size_t i = (hash ^ (hash >> 32)) & mask;; i = (i + 1) & mask) {
+    const Slot &slot = slots[i];
+    if (slot.hash == emptyHash) return NULL;
+    if (slot.hash == hash && re2::StringPiece(slot.file->path) == path) return slot.file;
+  }
+}
+
+File *FileMap::Insert(File *file) {
+  if ((used + 1) * 4 > slots.size() * 3) Reserve(count * 2 + 1);
+  uint64_t hash = Hash(file->path);
+  size_t mask = slots.size() - 1;
+  Slot *erased = NULL;
+  for (size_t i = (hash ^ (hash >> 32)) & mask;; i = (i + 1) & mask) {
+    Slot &slot = slots[i];
+    if (slot.hash == erasedHash) {
+      if (!erased) erased = &slot;
+    } else if (slot.hash == emptyHash) {
+      if (!erased) {
+        erased = &slot;
+        used++;
+      }
+      break;
+    } else if (slot.hash == hash && slot.file->path == file->path) {
+      return slot.file;
+    }
+  }
+  erased->hash = hash;
+  erased->file = file;
+  count++;
+  return file;
+}
+
+void FileMap::Reserve(size_t files) {
+  size_t capacity = 16;
+  while (capacity * 3 < files * 4) capacity *= 2;
+  if (capacity > slots.size() || used > count) Grow(std::max(capacity, slots.size()));
+}
+
+void FileMap::Grow(size_t capacity) {
+  std::vector<Slot> old(capacity, Slot{ emptyHash, NULL });
+  old.swap(slots);
+  size_t mask = slots.size() - 1;
+  for (const Slot &slot : old) {
+    if (slot.hash < liveHash) continue;
+    size_t i = (slot.hash ^ (slot.hash >> 32)) & mask;
+    while (slots[i].hash != emptyHash) i = (i + 1) & mask;
+    slots[i] = slot;
+  }
+  used = count;
+}
+
+FileMap::iterator FileMap::erase(iterator it) {
+  slots[it.slot].hash = erasedHash;
+  slots[it.slot].file = NULL;
+  count--;
+  return ++it;
+}
+
+void *File::operator new(size_t size) {
+  return Arena<File>::Allocate(size);
+}
+
+void File::operator delete(void *file, size_t size) {
+  Arena<File>::Release(file, size);
+}
+
+typedef std::vector<std::pair<std::string, std::vector<std::string>>> EachArgs;
+
+// A piece of the literal start of an input regex: either text, or a plain $(VAR) of an each block
+struct LeadingSegment {
+  std::string text, variable;
+  size_t end;
+};
+
+static bool isEachVariable(const std::string &name, const EachArgs &args) {
+  for (const auto &a : args) {
+    if (a.first == name) return true;
+  }
+  return false;
+}
+
+static std::vector<LeadingSegment> leadingSegments(const std::string &regex, const EachArgs &args) {
+  std::vector<LeadingSegment> segments;
+  size_t pos = 0;
+  while (pos < regex.size()) {
+    LeadingSegment segment;
+    if (regex.compare(pos, 2, "$(") == 0) {
+      size_t end = regex.find(')', pos);
+      if (end == regex.npos) break;
+      segment.variable = regex.substr(pos + 2, end - pos - 2);
+      if (!isEachVariable(segment.variable, args)) break;
+      pos = end + 1;
+    } else {
+      segment.text = literalRun(regex, pos);
+      if (segment.text.empty()) break;
+    }
+    segment.end = pos;
+    segments.push_back(segment);
+  }
+  return segments;
+}
+
+// A | outside of any group splits the whole regex, so its start is not a prefix of every match
+static bool hasAlternation(const std::string &regex) {
+  int depth = 0;
+  for (size_t i = 0; i < regex.size(); i++) {
+    if (regex[i] == '\\') {
+      i++;
+    } else if (regex[i] == '[') {
+      i = regex.find(']', i + 2);
+      if (i == regex.npos) return false;
+    } else if (regex[i] == '(') {
+      depth++;
+    } else if (regex[i] == ')') {
+      depth--;
+    } else if (regex[i] == '|' && depth == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Rather than copying a rule for every combination of the each variables, one rule takes the variables as parameters
+// if its input regex only uses them in its literal start, or not at all. The others are still copied for. Returns
+// the literal start, up to and including the last parameter in it.
+static std::vector<LeadingSegment> splitEachVariables(const std::string &inputRegex, const EachArgs &args, EachArgs &copied, std::vector<RuleParameter> &parameters) {
+  std::unordered_set<std::string> parametric;
+  for (const auto &a : args) parametric.insert(a.first);
+  std::vector<LeadingSegment> segments;
+  if (!hasAlternation(inputRegex)) segments = leadingSegments(inputRegex, args);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    while (!segments.empty() && !parametric.count(segments.back().variable)) segments.pop_back();
+    size_t restStart = segments.empty() ? 0 : segments.back().end;
+    for (size_t pos = inputRegex.find("$(", restStart); pos != inputRegex.npos; pos = inputRegex.find("$(", pos + 2)) {
+      size_t end = inputRegex.find(')', pos);
+      std::string name = (end == inputRegex.npos ? "" : inputRegex.substr(pos + 2, end - pos - 2));
+      if (parametric.erase(name)) {
+        changed = true;
+      } else if (!isEachVariable(name, args) && !parametric.empty()) {
+        // Anything else, like a function or a nested variable, may well use them
+        parametric.clear();
+        changed = true;
+      }
+    }
+  }
+  for (const auto &a : args) {
+    if (!parametric.count(a.first)) {
+      copied.push_back(a);
+      continue;
+    }
+    RuleParameter p;
+    p.name = a.first;
+    p.values = a.second;
+    p.inInput = false;
+    for (const auto &segment : segments) {
+      if (segment.variable == p.name) p.inInput = true;
+    }
+    parameters.push_back(p);
+  }
+  return segments;
+}
+
+static void instantiateRule(const std::string &inputRegex, const std::vector<LeadingSegment> &prefix, const std::vector<RuleParameter> &parameters, const std::string &inputLine, const std::string &outputLine, const std::string &buffer, std::unordered_map<std::string, std::string> &localVars, const EachArgs &args, std::vector<Rule *> &rules) {
   if (args.empty()) {
     std::unordered_map<std::string, std::string> escapedVars;
     for (auto p : localVars) {
       escapedVars[p.first] = RE2::QuoteMeta(p.second);
     }
-    rules.push_back(new Rule(replaceVars(inputRegex, escapedVars), inputLine, outputLine, buffer, localVars));
+    size_t restStart = prefix.empty() ? 0 : prefix.back().end;
+    std::string regex;
+    if (Expression(inputRegex.substr(restStart)).Evaluate(escapedVars, regex) != Expression::Ok) {
+      printf("Skipping rule for %s\n", inputRegex.c_str());
+      return;
+    }
+    Rule *rule = new Rule(regex, inputLine, outputLine, buffer, localVars);
+    rule->parameters = parameters;
+    for (const auto &segment : prefix) {
+      InputSegment s;
+      s.parameter = -1;
+      for (size_t i = 0; i < parameters.size(); i++) {
+        if (parameters[i].name == segment.variable) s.parameter = i;
+      }
+      if (s.parameter < 0) s.text = segment.variable.empty() ? segment.text : localVars[segment.variable];
+      if (s.parameter < 0 && !rule->inputPrefix.empty() && rule->inputPrefix.back().parameter < 0) {
+        rule->inputPrefix.back().text += s.text;
+      } else {
+        rule->inputPrefix.push_back(s);
+      }
+    }
+    rules.push_back(rule);
   } else {
     auto argc = args;
     auto p = argc.back();
     argc.pop_back();
     for (auto s : p.second) {
       localVars[p.first] = s;
-      instantiateRule(inputRegex, inputLine, outputLine, buffer, localVars, argc, rules);
+      instantiateRule(inputRegex, prefix, parameters, inputLine, outputLine, buffer, localVars, argc, rules);
     }
   }
 }
 
-void readFile(std::vector<Rule *> &rules, const std::string &path, std::unordered_map<std::string, File *> &fileMap, std::vector<File *>& files) {
+// Set by "scan includes" for the rule that comes after it
+static bool scanningIncludes = false;
+static std::vector<std::string> includePaths;
+
+void readFile(std::vector<Rule *> &rules, const std::string &path, FileMap &fileMap, std::vector<File *>& files, uint64_t *hash) {
   boost::filesystem::ifstream in(path);
   static char buffer[262144];
-  std::vector<std::pair<std::string, std::vector<std::string>>> args;
+  EachArgs args;
   while (in.good()) {
     in.getline(buffer, 262144);
     while (in.good() && buffer[strlen(buffer)-1] == '\\') {
       in.getline(buffer+strlen(buffer) - 1, 262144-strlen(buffer) + 1);
     }
+    if (hash) *hash = hash_bytes(buffer, strlen(buffer) + 1, *hash);
     char *firstHash = strchr(buffer, '#');
     size_t endPos = (firstHash ? firstHash - buffer : strlen(buffer));
     std::string line(buffer, endPos);
@@ -55,18 +275,48 @@ void readFile(std::vector<Rule *> &rules, const std::string &path, std::unordere
         inputRegex = inputRegex.substr(0, endPos);
       }
       in.getline(buffer, 1024);
+      if (hash) *hash = hash_bytes(buffer, strlen(buffer) + 1, *hash);
       std::unordered_map<std::string, std::string> localVars;
-      instantiateRule(inputRegex, inputLine, outputLine, buffer, localVars, args, rules);
+      EachArgs copied;
+      std::vector<RuleParameter> parameters;
+      std::vector<LeadingSegment> prefix = splitEachVariables(inputRegex, args, copied, parameters);
+      size_t first = rules.size();
+      instantiateRule(inputRegex, prefix, parameters, inputLine, outputLine, buffer, localVars, copied, rules);
+      for (size_t i = first; i < rules.size(); i++) {
+        rules[i]->scansIncludes = scanningIncludes;
+        rules[i]->includePaths = includePaths;
+      }
+      scanningIncludes = false;
+      includePaths.clear();
     } else if (line.substr(0, 8) == "depfiles") {
       for (const auto& str : split(line.substr(9), ' ')) {
         depfiles.Add(str, NULL);
+        // Dependency files need not be the output of any rule, so the walk has to reach them on their own
+        scanScope.Add(str);
       }
     } else if (line.substr(0, 9) == "generated") {
       for (const auto& str : split(line.substr(10), ' ')) {
         generateds.Add(str, NULL);
+        scanScope.Add(str);
       }
+    } else if (line.substr(0, 6) == "ignore") {
+      for (const auto& str : split(line.substr(7), ' ')) {
+        ignores.Add(str, false, false);
+      }
+    } else if (line.substr(0, 9) == "immutable") {
+      for (const auto& str : split(line.substr(10), ' ')) {
+        immutables.push_back(str);
+      }
+    } else if (line.substr(0, 13) == "scan includes") {
+      scanningIncludes = true;
+      includePaths = split(line.substr(std::min<size_t>(line.size(), 14)), ' ');
+    } else if (line == "scan walk") {
+      useGitIndex = false;
+    } else if (line.substr(0, 12) == "regex budget") {
+      int megabytes = atoi(line.substr(12).c_str());
+      if (megabytes > 0) regexBudget = (int64_t)megabytes << 20;
     } else if (line.substr(0, 7) == "include") {
-      readFile(rules, line.substr(8), fileMap, files);
+      readFile(rules, line.substr(8), fileMap, files, hash);
     } else if (line.substr(0, 4) == "each") {
       std::string l = line.substr(5);
       size_t colonPos = l.find_first_of(':');
@@ -97,7 +347,7 @@ void readFile(std::vector<Rule *> &rules, const std::string &path, std::unordere
   }
 }
 
-bool readRuleFile(std::vector<Rule *> &rules, std::unordered_map<std::string, File *> &fileMap, std::vector<File *>& files) {
+bool readRuleFile(std::vector<Rule *> &rules, FileMap &fileMap, std::vector<File *>& files, uint64_t &hash) {
   boost::filesystem::path current = boost::filesystem::current_path();
   while (!current.empty()) {
     boost::filesystem::path rulefile = current / "Rulefile.bob",
@@ -114,17 +364,18 @@ bool readRuleFile(std::vector<Rule *> &rules, std::unordered_map<std::string, Fi
         printf("Using target override %s\n", targetname);
     }
 
+    boost::filesystem::path found;
     if (boost::filesystem::is_regular_file(rulefile)) {
-      boost::filesystem::current_path(current);
-      readFile(rules, rulefile.string(), fileMap, files); 
-      return true;
+      found = rulefile;
     } else if (boost::filesystem::is_regular_file(bobfile)) {
-      boost::filesystem::current_path(current);
-      readFile(rules, bobfile.string(), fileMap, files); 
-      return true;
+      found = bobfile;
     } else if (boost::filesystem::is_regular_file(simpleRulefile)) {
+      found = simpleRulefile;
+    }
+    if (!found.empty()) {
       boost::filesystem::current_path(current);
-      readFile(rules, simpleRulefile.string(), fileMap, files); 
+      readFile(rules, found.string(), fileMap, files, &hash); 
+      readIgnoreFile(".bobignore", hash);
       return true;
     }
     current = current.parent_path();
@@ -132,41 +383,30 @@ bool readRuleFile(std::vector<Rule *> &rules, std::unordered_map<std::string, Fi
   return false;
 }
 
-void loadDependenciesFrom(std::string &file, std::vector<Rule*> &rules, std::unordered_map<std::string, File *> &fileMap, std::vector<File *> &files) {
-  if (!boost::filesystem::is_regular_file(file)) return;
-  std::vector<int> m;
-  if (!depfiles.Match(file, &m)) {
-    return;
+TEST(fileMapFindsFilesPastErasedOnesAndAfterGrowing) {
+  FileMap fileMap;
+  std::vector<File *> files;
+  for (int n = 0; n < 100; n++) create_file("src/file" + std::to_string(n) + ".c", fileMap, files);
+  ASSERT_EQ(fileMap.size(), 100);
+  for (auto it = fileMap.begin(); it != fileMap.end();) {
+    it = ((*it)->path.size() % 2) ? fileMap.erase(it) : ++it;
   }
-  readFile(rules, file, fileMap, files);
-}
-
-void getFiles(std::vector<File *> &files) {
-  boost::filesystem::recursive_directory_iterator it("."), end;
-  for (;it != end; ++it) {
-    if (boost::filesystem::is_regular_file(it->path())) {
-      files.push_back(new File(it->path().string().substr(2)));
-    }
+  size_t left = 0;
+  for (File *f : files) {
+    bool kept = (f->path.size() % 2) == 0;
+    if (kept) left++;
+    bool found = fileMap.Find(f->path) == (kept ? f : NULL);
+    ASSERT_EQ(found, true);
   }
+  ASSERT_EQ(fileMap.size(), left);
+  File *again = new File("src/file1.c");
+  bool inserted = fileMap.Insert(again) == again;
+  ASSERT_EQ(inserted, true);
+  File *copy = new File(files[10]->path);
+  bool alreadyThere = fileMap.Insert(copy) == files[10];
+  delete copy;
+  ASSERT_EQ(alreadyThere, true);
+  ASSERT_EQ(fileMap.size(), left + 1);
+  delete again;
+  for (File *f : files) delete f;
 }
-
-void File::Invalidate() {
-  if (!shouldRebuild) {
-    shouldRebuild = true;
-    for (RuleInstance *d : dependencies) {
-      d->Invalidate();
-    }
-  }
-}
-
-void File::SignalRebuilt() {
-  if (shouldRebuild) {
-    shouldRebuild = false;
-    for (RuleInstance *d : dependencies) {
-      if (d->CanRun()) {
-        runnable.push(d);
-      }
-    }
-  }
-}
-
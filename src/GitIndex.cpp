@@ -0,0 +1,207 @@
+#include "GitIndex.h"
+#include "Scan.h"
+#include "File.h"
+#include "Test.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+
+static uint32_t be32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint16_t be16(const unsigned char *p) {
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void addDirectory(GitIndex &index, const std::string &dir) {
+  if (index.directories.count(dir)) return;
+  index.directories[dir];
+  if (dir.empty()) return;
+  size_t slash = dir.find_last_of('/');
+  std::string parent = (slash == dir.npos) ? std::string() : dir.substr(0, slash);
+  addDirectory(index, parent);
+  index.directories[parent].dirs.push_back(dir);
+}
+
+// Entries are sorted by path, so files of the same directory come one after the other
+static void addFile(GitIndex &index, const std::string &path, std::string &lastDir, IndexedDirectory *&lastEntry) {
+  size_t slash = path.find_last_of('/');
+  size_t dirLength = (slash == path.npos) ? 0 : slash;
+  if (!lastEntry || lastDir.size() != dirLength || lastDir.compare(0, dirLength, path, 0, dirLength) != 0) {
+    lastDir.assign(path, 0, dirLength);
+    addDirectory(index, lastDir);
+    lastEntry = &index.directories[lastDir];
+  }
+  lastEntry->files.push_back(path);
+}
+
+// See Documentation/technical/index-format.txt in git for the layout
+static bool parseIndex(const unsigned char *data, size_t size, GitIndex &index) {
+  if (size < 12 + 20 || memcmp(data, "DIRC", 4) != 0) return false;
+  uint32_t version = be32(data + 4), count = be32(data + 8);
+  if (version < 2 || version > 4) return false;
+  const unsigned char *p = data + 12, *end = data + size - 20;
+  std::string name, lastAdded, lastDir;
+  IndexedDirectory *lastEntry = NULL;
+  for (uint32_t i = 0; i < count; i++) {
+    const unsigned char *entry = p;
+    if (end - p < 62) return false;
+    uint32_t mode = be32(p + 24);
+    uint16_t flags = be16(p + 60), extendedFlags = 0;
+    p += 62;
+    if (flags & 0x4000) {
+      if (version < 3 || end - p < 2) return false;
+      extendedFlags = be16(p);
+      p += 2;
+    }
+    const unsigned char *nul;
+    if (version == 4) {
+      // Name is stored as the number of bytes to drop from the previous name, then the new suffix
+      if (p >= end) return false;
+      unsigned char c = *p++;
+      size_t strip = c & 127;
+      while (c & 128) {
+        if (p >= end) return false;
+        c = *p++;
+        strip = ((strip + 1) << 7) | (c & 127);
+      }
+      if (strip > name.size() || !(nul = (const unsigned char *)memchr(p, 0, end - p))) return false;
+      name.resize(name.size() - strip);
+      name.append((const char *)p, nul - p);
+      p = nul + 1;
+    } else {
+      if (!(nul = (const unsigned char *)memchr(p, 0, end - p))) return false;
+      name.assign((const char *)p, nul - p);
+      p = entry + ((nul - entry + 8) & ~7);
+      if (p > end) return false;
+    }
+
+    uint32_t type = mode >> 12;
+    if (type == 04) return false; // sparse directory entry; the files below it are not listed
+    if (type != 010 && type != 012) continue; // only regular files and symlinks; not submodules
+    if (extendedFlags & 0x4000) continue; // skip-worktree, not checked out
+    if (((flags >> 12) & 3) && name == lastAdded) continue; // further stages of a merge conflict
+    addFile(index, name, lastDir, lastEntry);
+    lastAdded = name;
+  }
+  while (end - p >= 8) {
+    if (memcmp(p, "link", 4) == 0 || memcmp(p, "sdir", 4) == 0) return false; // split or sparse index
+    uint32_t extensionSize = be32(p + 4);
+    if ((size_t)(end - p - 8) < extensionSize) return false;
+    p += 8 + extensionSize;
+  }
+  return true;
+}
+
+bool readGitIndex(const std::string &path, GitIndex &index) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+  index.lastWrite = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+  bool ok = parseIndex((const unsigned char *)map, st.st_size, index);
+  munmap(map, st.st_size);
+  if (!ok) index.directories.clear();
+  return ok;
+}
+
+static void putBE32(std::string &out, uint32_t v) {
+  unsigned char b[4] = { (unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char)v };
+  out.append((const char *)b, 4);
+}
+
+static void writeTestIndex(const std::string &path, const std::vector<std::string> &files) {
+  std::string out = "DIRC";
+  putBE32(out, 2);
+  putBE32(out, files.size());
+  for (const auto &f : files) {
+    std::string entry(62, '\0');
+    entry[24] = (char)0x00; entry[25] = (char)0x00; entry[26] = (char)0x81; entry[27] = (char)0xA4;
+    entry[60] = (char)(f.size() >> 8);
+    entry[61] = (char)f.size();
+    entry += f;
+    entry.append(8 - (entry.size() % 8), '\0');
+    out += entry;
+  }
+  out.append(20, '\0');
+  FILE *fd = fopen(path.c_str(), "wb");
+  fwrite(out.data(), 1, out.size(), fd);
+  fclose(fd);
+}
+
+static std::vector<std::string> scanPaths(const ScanScope &scope, const IgnoreList &ignores, const GitIndex *index, size_t &read) {
+  std::vector<File *> files;
+  std::vector<Directory> dirs;
+  read = getFiles(files, dirs, 2, scope, ignores, index, NULL);
+  std::vector<std::string> paths;
+  for (File *f : files) {
+    paths.push_back(f->path);
+    delete f;
+  }
+  std::sort(paths.begin(), paths.end());
+  return paths;
+}
+
+TEST(gitIndexScanMatchesFullWalk) {
+  boost::filesystem::path old = boost::filesystem::current_path();
+  boost::filesystem::path root = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bobtest-%%%%%%%%");
+  std::vector<std::string> tracked = { "Rulefile", "src/a.c", "src/lib/b.c", "src/lib/c.h", "tools/gen.py", "include/d.h" };
+  for (const auto &f : tracked) {
+    boost::filesystem::create_directories((root / f).parent_path());
+    fclose(fopen((root / f).string().c_str(), "w"));
+  }
+  boost::filesystem::create_directories(root / ".git");
+  boost::filesystem::current_path(root);
+  // A file a rule names that git does not track, in a directory the scan only passes through
+  fclose(fopen("tools/local.cfg", "w"));
+  // All directories are older than the index
+  struct timeval past[2] = { { time(NULL) - 3600, 0 }, { time(NULL) - 3600, 0 } };
+  const char *dirs[] = { ".", "src", "src/lib", "tools", "include" };
+  for (const char *d : dirs) utimes(d, past);
+  writeTestIndex(".git/index", tracked);
+
+  GitIndex index;
+  bool loaded = readGitIndex(".git/index", index);
+  ScanScope scope;
+  scope.Add("src/lib/(.*)\\.c");
+  scope.Add("tools/gen\\.py");
+  scope.Add("tools/local\\.cfg");
+  scope.Add("tools/missing\\.py");
+  IgnoreList ignores;
+  ignores.Add("\\.git", false, true);
+  ignores.Compile();
+  size_t walkRead, indexRead;
+  std::vector<std::string> walked = scanPaths(scope, ignores, NULL, walkRead), fromIndex = scanPaths(scope, ignores, &index, indexRead);
+
+  boost::filesystem::current_path(old);
+  boost::filesystem::remove_all(root);
+  ASSERT_EQ(loaded, true);
+  // ".", "src", "src/lib" and "tools" when walking; only "src/lib", which the rules read from, with the index
+  ASSERT_EQ(walkRead, 4);
+  ASSERT_EQ(indexRead, 1);
+  ASSERT_EQ(walked.size(), 4);
+  ASSERT_EQ(fromIndex.size(), walked.size());
+  for (size_t i = 0; i < walked.size(); i++) {
+    ASSERT_STREQ(fromIndex[i], walked[i]);
+  }
+  ASSERT_STREQ(fromIndex[3], "tools/local.cfg");
+}
+
+TEST(gitIndexRejectsUnknownVersion) {
+  unsigned char data[32] = { 'D', 'I', 'R', 'C', 0, 0, 0, 5 };
+  GitIndex index;
+  ASSERT_EQ(parseIndex(data, sizeof(data), index), false);
+}
@@ -0,0 +1,290 @@
+#include "Graph.h"
+#include "Depfile.h"
+#include "File.h"
+#include "Funcs.h"
+#include "Rule.h"
+#include "Test.h"
+
+Graph graph;
+const uint32_t Graph::NoId;
+
+bool Comparer::operator()(uint32_t first, uint32_t second) {
+  return graph.Delay(first) < graph.Delay(second);
+}
+
+void Graph::Build(const std::vector<RuleInstance *> &instanceList, FileMap &fileMap, const DependencyLists &dependencyLists) {
+  files.clear();
+  files.reserve(fileMap.size());
+  for (File *f : fileMap) {
+    f->id = files.size();
+    files.push_back(f);
+  }
+  instances = instanceList;
+  for (size_t i = 0; i < instances.size(); i++) instances[i]->id = i;
+
+  size_t users = 0, inputs = 0, outputs = 0;
+  for (File *f : files) users += f->dependencies.size();
+  for (RuleInstance *ri : instances) {
+    inputs += ri->inputs.size();
+    outputs += ri->outputs.size();
+  }
+
+  generator.assign(files.size(), NoId);
+  shouldRebuild.assign(files.size(), false);
+  lastWrite.assign(files.size(), 1);
+  userStart.assign(1, 0);
+  userStart.reserve(files.size() + 1);
+  userInstance.clear();
+  userInstance.reserve(users);
+  for (File *f : files) {
+    if (f->generatingRule) generator[f->id] = f->generatingRule->id;
+    for (RuleInstance *ri : f->dependencies) userInstance.push_back(ri->id);
+    userStart.push_back(userInstance.size());
+    std::vector<RuleInstance *>().swap(f->dependencies);
+  }
+
+  listStart.assign(1, 0);
+  listStart.reserve(dependencyLists.lists.size() + 1);
+  listFile.clear();
+  for (DependencyList *list : dependencyLists.lists) {
+    for (File *f : list->files) listFile.push_back(f->id);
+    listStart.push_back(listFile.size());
+  }
+  listNewest.assign(dependencyLists.lists.size(), 1);
+
+  mainOutput.resize(instances.size());
+  usesList.resize(instances.size());
+  wantToRun.assign(instances.size(), false);
+  somethingToDo.assign(instances.size(), false);
+  delay.assign(instances.size(), -1);
+  inputStart.assign(1, 0);
+  inputStart.reserve(instances.size() + 1);
+  inputFile.clear();
+  inputFile.reserve(inputs);
+  inputRelation.clear();
+  inputRelation.reserve(inputs);
+  outputStart.assign(1, 0);
+  outputStart.reserve(instances.size() + 1);
+  outputFile.clear();
+  outputFile.reserve(outputs);
+  for (RuleInstance *ri : instances) {
+    mainOutput[ri->id] = ri->mainOutput->id;
+    usesList[ri->id] = ri->dependencyList ? ri->dependencyList->id : NoId;
+    // In the order of the maps they come from, which is the order $(INPUTS) and $(OUTPUTS) always had
+    for (const auto &in : ri->inputs) {
+      inputFile.push_back(in.first->id);
+      inputRelation.push_back(in.second);
+    }
+    inputStart.push_back(inputFile.size());
+    for (File *f : ri->outputs) outputFile.push_back(f->id);
+    outputStart.push_back(outputFile.size());
+    std::unordered_map<File *, Relation>().swap(ri->inputs);
+    std::unordered_set<File *>().swap(ri->outputs);
+  }
+}
+
+std::time_t Graph::Timestamp(uint32_t file) {
+  if (lastWrite[file] == 1) {
+    const std::string &path = files[file]->path;
+    if (boost::filesystem::is_regular_file(path))
+      lastWrite[file] = boost::filesystem::last_write_time(path);
+    else
+      lastWrite[file] = 0;
+  }
+  return lastWrite[file];
+}
+
+std::time_t Graph::OldestOutput(uint32_t instance) {
+  std::time_t oldestOutput = 0;
+  for (uint32_t e = outputStart[instance]; e != outputStart[instance + 1]; e++) {
+    std::time_t t = Timestamp(outputFile[e]);
+    if (oldestOutput == 0 || (t != 0 && oldestOutput > t))
+      oldestOutput = t;
+  }
+  return oldestOutput;
+}
+
+std::time_t Graph::ListNewest(uint32_t list) {
+  if (listNewest[list] == 1) {
+    std::time_t newest = 0;
+    for (uint32_t e = listStart[list]; e != listStart[list + 1]; e++) {
+      std::time_t t = Timestamp(listFile[e]);
+      if (t == 0) {
+        newest = 0;
+        break;
+      }
+      newest = std::max(newest, t);
+    }
+    listNewest[list] = newest;
+  }
+  return listNewest[list];
+}
+
+uint64_t Graph::Delay(uint32_t instance) {
+  if (delay[instance] == 0) {
+    uint64_t timeTaken = instances[instance]->runningAverageTimeTaken.count();
+    delay[instance] = timeTaken; // Only for if there's a cycle
+    uint64_t curDelay = 0;
+    for (uint32_t o = outputStart[instance]; o != outputStart[instance + 1]; o++) {
+      uint32_t out = outputFile[o];
+      for (uint32_t u = userStart[out]; u != userStart[out + 1]; u++) {
+        uint32_t user = userInstance[u];
+        if (wantToRun[user] && somethingToDo[user])
+          curDelay = std::max(curDelay, Delay(user));
+      }
+    }
+    delay[instance] = curDelay + timeTaken;
+  }
+  return delay[instance];
+}
+
+void Graph::Invalidate(uint32_t instance) {
+  somethingToDo[instance] = true;
+  InvalidateFile(mainOutput[instance]);
+  for (uint32_t e = outputStart[instance]; e != outputStart[instance + 1]; e++) {
+    InvalidateFile(outputFile[e]);
+  }
+}
+
+void Graph::InvalidateFile(uint32_t file) {
+  if (!shouldRebuild[file]) {
+    shouldRebuild[file] = true;
+    for (uint32_t u = userStart[file]; u != userStart[file + 1]; u++) {
+      Invalidate(userInstance[u]);
+    }
+  }
+}
+
+void Graph::SignalRebuilt(uint32_t file) {
+  if (shouldRebuild[file]) {
+    shouldRebuild[file] = false;
+    for (uint32_t u = userStart[file]; u != userStart[file + 1]; u++) {
+      if (CanRun(userInstance[u])) {
+        runnable.push(userInstance[u]);
+      }
+    }
+  }
+}
+
+bool Graph::CanRun(uint32_t instance) {
+  if (!wantToRun[instance]) return false;
+  for (uint32_t e = inputStart[instance]; e != inputStart[instance + 1]; e++) {
+    if (shouldRebuild[inputFile[e]]) {
+      return false;
+    }
+  }
+  wantToRun[instance] = false;
+  return true;
+}
+
+void Graph::Check(uint32_t instance) {
+  RuleInstance *ri = instances[instance];
+  if (verbose) printf("check for %s ?\n", ri->mainOutput->path.c_str());
+  if (ri->IsPseudoTarget()) {
+    if (verbose) printf("Rebuilding; pseudotarget\n");
+    Invalidate(instance);
+    return;
+  }
+
+  for (uint32_t e = outputStart[instance]; e != outputStart[instance + 1]; e++) {
+    const std::string &path = files[outputFile[e]]->path;
+    if (!boost::filesystem::is_regular_file(path)) {
+      Invalidate(instance);
+      if (verbose) printf("output %s does not exist\n", path.c_str());
+      return;
+    }
+  }
+
+  std::time_t youngestInput = 0;
+  for (uint32_t e = inputStart[instance]; e != inputStart[instance + 1]; e++) {
+    if (inputRelation[e] == BuildBefore)
+      continue;
+    const std::string &path = files[inputFile[e]]->path;
+    if (!boost::filesystem::is_regular_file(path)) {
+      if (verbose) printf("input %s does not exist\n", path.c_str());
+      Invalidate(instance);
+      return;
+    }
+    youngestInput = std::max(youngestInput, Timestamp(inputFile[e]));
+  }
+  uint32_t list = usesList[instance];
+  if (list != NoId) {
+    std::time_t newest = ListNewest(list);
+    if (newest == 0) {
+      if (verbose) {
+        for (uint32_t e = listStart[list]; e != listStart[list + 1]; e++) {
+          if (Timestamp(listFile[e]) == 0) {
+            printf("input %s does not exist\n", files[listFile[e]]->path.c_str());
+            break;
+          }
+        }
+      }
+      Invalidate(instance);
+      return;
+    }
+    youngestInput = std::max(youngestInput, newest);
+  }
+
+  std::time_t oldestOutput = OldestOutput(instance);
+  if (oldestOutput < youngestInput) {
+    if (verbose) printf("oldest output is older than the newest input\n");
+    Invalidate(instance);
+    return;
+  }
+
+  if (ri->storedRv) {
+    if (verbose) printf("last build was not successful; have to rebuild\n");
+    Invalidate(instance);
+    return;
+  }
+
+  if (verbose) printf("not rebuilding, all inputs up to date and no error on last run\n");
+}
+
+TEST(graphKeepsEdgesInRowsAndInvalidatesAlongThem) {
+  FileMap fileMap;
+  std::vector<File *> files;
+  File *source = create_file("a.c", fileMap, files);
+  File *header = create_file("a.h", fileMap, files);
+  File *object = create_file("a.o", fileMap, files);
+  File *app = create_file("app", fileMap, files);
+  Rule compileRule(".*\\.c", "", "", "cc", std::unordered_map<std::string, std::string>());
+  RuleInstance *compile = new RuleInstance(&compileRule), *link = new RuleInstance(&compileRule);
+  compile->mainOutput = object;
+  compile->outputs.insert(object);
+  object->generatingRule = compile;
+  compile->inputs[source] = GeneratingInput;
+  compile->inputs[header] = IndirectInput;
+  source->dependencies.push_back(compile);
+  header->dependencies.push_back(compile);
+  link->mainOutput = app;
+  link->outputs.insert(app);
+  app->generatingRule = link;
+  link->inputs[object] = GeneratingInput;
+  object->dependencies.push_back(link);
+  std::vector<RuleInstance *> instances = { compile, link };
+
+  Graph g;
+  g.Build(instances, fileMap, DependencyLists());
+  ASSERT_EQ(g.inputStart[compile->id + 1] - g.inputStart[compile->id], 2);
+  ASSERT_EQ(g.inputFile[g.inputStart[link->id]], object->id);
+  ASSERT_EQ(g.generator[object->id], compile->id);
+  ASSERT_EQ(g.generator[source->id], Graph::NoId);
+  ASSERT_EQ(g.userStart[object->id + 1] - g.userStart[object->id], 1);
+  bool edgesMovedOut = compile->inputs.empty() && object->dependencies.empty();
+  ASSERT_EQ(edgesMovedOut, true);
+
+  g.InvalidateFile(header->id);
+  bool linkInvalidated = g.somethingToDo[link->id] && g.shouldRebuild[app->id];
+  ASSERT_EQ(linkInvalidated, true);
+  bool sourceUntouched = !g.shouldRebuild[source->id];
+  ASSERT_EQ(sourceUntouched, true);
+  g.wantToRun[link->id] = true;
+  bool waitsForObject = !g.CanRun(link->id);
+  ASSERT_EQ(waitsForObject, true);
+
+  delete compile;
+  delete link;
+  for (File *f : files) delete f;
+}
+
@@ -0,0 +1,213 @@
+#include "Includes.h"
+#include "Depfile.h"
+#include "File.h"
+#include "Funcs.h"
+#include "Rule.h"
+#include "RuleInstance.h"
+#include "Snapshot.h"
+#include "Scan.h"
+#include "Test.h"
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstring>
+
+void parseIncludes(const char *data, size_t size, std::vector<IncludeDirective> &includes) {
+  const char *p = data, *end = data + size;
+  while (p != end) {
+    const char *lineEnd = (const char *)memchr(p, '\n', end - p);
+    if (!lineEnd) lineEnd = end;
+    while (p != lineEnd && (*p == ' ' || *p == '\t')) p++;
+    if (p != lineEnd && *p == '#') {
+      p++;
+      while (p != lineEnd && (*p == ' ' || *p == '\t')) p++;
+      if (lineEnd - p > 7 && memcmp(p, "include", 7) == 0) {
+        p += 7;
+        while (p != lineEnd && (*p == ' ' || *p == '\t')) p++;
+        if (p != lineEnd && (*p == '"' || *p == '<')) {
+          char close = (*p == '"') ? '"' : '>';
+          const char *name = ++p;
+          while (p != lineEnd && *p != close) p++;
+          if (p != lineEnd && p != name) {
+            IncludeDirective include;
+            include.name.assign(name, p);
+            include.quoted = (close == '"');
+            includes.push_back(include);
+          }
+        }
+      }
+    }
+    p = (lineEnd == end) ? end : lineEnd + 1;
+  }
+}
+
+// Takes out "." and "name/.." so that the path is as the scan of the tree names it
+static std::string normalize(const std::string &path) {
+  std::vector<std::string> parts;
+  for (auto &part : split(path, '/')) {
+    if (part == ".") continue;
+    if (part == ".." && !parts.empty() && parts.back() != "..") {
+      parts.pop_back();
+      continue;
+    }
+    parts.push_back(part);
+  }
+  std::string out = (path[0] == '/') ? "/" : "";
+  for (const auto &part : parts) {
+    if (!out.empty() && out != "/") out += '/';
+    out += part;
+  }
+  return out;
+}
+
+namespace {
+
+// Headers are usually outside of what the rules match, so the tree scan did not make them; they are looked for on
+// disk then, once per path. Ones under an immutable prefix are not looked at, nor what they include.
+struct Resolver {
+  Resolver(FileMap &fileMap, std::vector<File *> &files) : fileMap(fileMap), files(files) {}
+  File *Find(const std::string &path) {
+    if (isImmutable(path)) return NULL;
+    File *f = fileMap.Find(path);
+    if (f || missing.count(path)) return f;
+    if (lastWriteStamp(path)) return create_file(path, fileMap, files);
+    missing.insert(path);
+    return NULL;
+  }
+  // The same name is included from many files, and only where a quoted one is included from matters
+  File *Resolve(const IncludeDirective &include, const std::string &from, const Rule *rule) {
+    if (include.name[0] == '/') return NULL;
+    size_t slash = from.find_last_of('/');
+    std::string dir = (!include.quoted || slash == from.npos) ? std::string() : from.substr(0, slash + 1);
+    std::string key((const char *)&rule, sizeof(rule));
+    key += include.quoted ? '"' : '<';
+    key += dir;
+    key += '\0';
+    key += include.name;
+    auto it = resolved.find(key);
+    if (it != resolved.end()) return it->second;
+    File *f = include.quoted ? Find(normalize(dir + include.name)) : NULL;
+    for (size_t i = 0; !f && i < rule->includePaths.size(); i++) {
+      f = Find(normalize(rule->includePaths[i] + "/" + include.name));
+    }
+    resolved.insert(std::make_pair(key, f));
+    return f;
+  }
+  FileMap &fileMap;
+  std::vector<File *> &files;
+  std::unordered_set<std::string> missing;
+  std::unordered_map<std::string, File *> resolved;
+};
+
+// A file as a rule sees it; the same name can resolve differently with other include paths
+typedef std::pair<File *, const Rule *> Scanned;
+
+struct ScannedHash {
+  size_t operator()(const Scanned &s) const {
+    return std::hash<File *>()(s.first) * 31 + std::hash<const Rule *>()(s.second);
+  }
+};
+
+}
+
+void scanIncludes(const std::vector<RuleInstance *> &instances, FileMap &fileMap, std::vector<File *> &files, FoundInputs &found, size_t threadCount) {
+  Resolver resolver(fileMap, files);
+  // Every file as each rule sees it gets a number, and the files it includes are kept by those
+  std::unordered_map<Scanned, uint32_t, ScannedHash> numbers;
+  std::vector<Scanned> scanned;
+  std::vector<std::vector<uint32_t>> included;
+  auto number = [&](const Scanned &s) -> uint32_t {
+    auto it = numbers.insert(std::make_pair(s, (uint32_t)scanned.size()));
+    if (it.second) {
+      scanned.push_back(s);
+      included.push_back(std::vector<uint32_t>());
+    }
+    return it.first->second;
+  };
+  for (RuleInstance *ri : instances) {
+    if (!ri->rule->scansIncludes) continue;
+    for (const auto &in : ri->inputs) {
+      if (in.second == Input || in.second == GeneratingInput) number(Scanned(in.first, ri->rule));
+    }
+  }
+
+  // Breadth first, so that the files of each step can be read on threads
+  std::unordered_map<File *, const std::vector<IncludeDirective> *> read;
+  for (size_t done = 0; done != scanned.size();) {
+    size_t end = scanned.size();
+    std::vector<File *> toRead;
+    for (size_t n = done; n != end; n++) {
+      if (read.insert(std::make_pair(scanned[n].first, (const std::vector<IncludeDirective> *)NULL)).second) toRead.push_back(scanned[n].first);
+    }
+    std::vector<const std::vector<IncludeDirective> *> results(toRead.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&] {
+      for (size_t i = next++; i < toRead.size(); i = next++) results[i] = includeCache.Includes(toRead[i]->path);
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(threadCount, toRead.size()); i++) threads.push_back(std::thread(worker));
+    worker();
+    for (auto &t : threads) t.join();
+    for (size_t i = 0; i < toRead.size(); i++) read[toRead[i]] = results[i];
+
+    for (; done != end; done++) {
+      Scanned s = scanned[done];
+      const std::vector<IncludeDirective> *includes = read[s.first];
+      if (!includes) continue;
+      for (const auto &include : *includes) {
+        File *f = resolver.Resolve(include, s.first->path, s.second);
+        if (f) {
+          uint32_t n = number(Scanned(f, s.second));
+          included[done].push_back(n);
+        }
+      }
+    }
+  }
+
+  std::vector<uint8_t> made(scanned.size());
+  for (size_t n = 0; n < scanned.size(); n++) made[n] = FoundInputs::IsMade(scanned[n].first);
+  std::vector<uint32_t> reachedBy(scanned.size(), 0xFFFFFFFF);
+  std::vector<uint32_t> toVisit;
+  for (uint32_t i = 0; i < instances.size(); i++) {
+    RuleInstance *ri = instances[i];
+    if (!ri->rule->scansIncludes) continue;
+    for (const auto &in : ri->inputs) {
+      if (in.second != Input && in.second != GeneratingInput) continue;
+      uint32_t n = numbers[Scanned(in.first, ri->rule)];
+      reachedBy[n] = i;
+      toVisit.push_back(n);
+    }
+    while (!toVisit.empty()) {
+      uint32_t n = toVisit.back();
+      toVisit.pop_back();
+      for (uint32_t m : included[n]) {
+        if (reachedBy[m] == i) continue;
+        reachedBy[m] = i;
+        toVisit.push_back(m);
+        found.Add(ri, scanned[m].first, made[m]);
+      }
+    }
+  }
+}
+
+static std::string describe(const std::vector<IncludeDirective> &includes) {
+  std::string out;
+  for (const auto &include : includes) out += (include.quoted ? "\"" + include.name + "\"" : "<" + include.name + ">") + " ";
+  return out;
+}
+
+TEST(includesAreFoundOnDirectiveLinesOnly) {
+  const char text[] =
+    "#include \"a.h\"\n"
+    "  #  include <sys/b.h> // why\n"
+    "#include_next <c.h>\n"
+    "// #include \"commented.h\"\n"
+    "#define X \"#include <d.h>\"\n"
+    "#include MACRO\n"
+    "#include \"last.h\"";
+  std::vector<IncludeDirective> includes;
+  parseIncludes(text, sizeof(text) - 1, includes);
+  ASSERT_STREQ(describe(includes), "\"a.h\" <sys/b.h> \"last.h\" ");
+}
+
@@ -0,0 +1,574 @@
+#include "Matcher.h"
+#include "File.h"
+#include "RuleInstance.h"
+#include "Funcs.h"
+#include "Scan.h"
+#include "Test.h"
+#include <algorithm>
+#include <sstream>
+#include <cstring>
+
+// Waking the other threads costs more than matching a few files
+static const size_t minimumParallelRound = 64;
+
+// RE2's own default
+int64_t regexBudget = 8 << 20;
+
+// The DFA of a set needs room for a few hundred states to run at full speed, and each state takes a few bytes for
+// every instruction in the program. Packing sets up to this size leaves that room.
+static const int64_t budgetPerInstruction = 1024;
+
+static RE2::Options rulesetOptions() {
+  RE2::Options opts;
+  opts.set_never_capture(true);
+  opts.set_one_line(true);
+  opts.set_max_mem(regexBudget);
+  return opts;
+}
+
+Matcher::Matcher(const ScanScope &scope, size_t threadCount)
+: scope(scope)
+, fallbacks(0)
+, round(NULL)
+, next(0)
+, tried(0)
+, evaluations(0)
+, busy(0)
+, generation(0)
+, stopping(false)
+{
+  for (size_t i = 1; i < threadCount; i++) {
+    threads.push_back(std::thread([this] { Worker(); }));
+  }
+}
+
+Matcher::~Matcher() {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    stopping = true;
+    start.notify_all();
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+// The extension of a path, or of the suffix of a pattern: the text from the last dot in the last path component
+static std::string extensionOf(const std::string &path, bool &found) {
+  size_t dot = path.find_last_of("./");
+  found = (dot != path.npos && path[dot] == '.');
+  return found ? path.substr(dot) : std::string();
+}
+
+void Matcher::Compile(const std::vector<Rule *> &rules) {
+  size_t rc = 0, literal = 0, prefixSuffix = 0;
+  // Rules with the same regex share their Pattern
+  std::unordered_map<const Pattern *, size_t> groupOf;
+  for (Rule *r : rules) {
+    rc++;
+    auto known = groupOf.find(r->inputMatcher.get());
+    if (known != groupOf.end() && r->inputPrefix.empty()) {
+      groups[known->second].rules.push_back(r);
+      continue;
+    }
+
+    RuleGroup g;
+    g.regex = r->simpleMatcherString;
+    g.rules.push_back(r);
+    g.nonEmpty = false;
+    g.parametric = !r->inputPrefix.empty();
+    size_t pos = 0;
+    g.prefix = literalRun(g.regex, pos);
+    if (pos == g.regex.size()) {
+      g.kind = RuleGroup::Literal;
+    } else {
+      int captures = r->inputMatcher->CaptureCount();
+      const char *wildcards[] = { "(.*)", "(.+)", ".*", ".+" };
+      g.kind = RuleGroup::Complex;
+      for (const char *w : wildcards) {
+        if (g.regex.compare(pos, strlen(w), w) != 0 || captures != (w[0] == '(' ? 1 : 0)) continue;
+        size_t end = pos + strlen(w);
+        g.suffix = literalRun(g.regex, end);
+        if (end == g.regex.size()) {
+          g.kind = RuleGroup::PrefixSuffix;
+          g.nonEmpty = (strchr(w, '+') != NULL);
+        }
+        break;
+      }
+    }
+
+    int index = groups.size();
+    if (g.kind == RuleGroup::Literal && !g.parametric) {
+      literalGroups[g.prefix].push_back(index);
+      literal++;
+    } else if (g.kind != RuleGroup::Complex) {
+      // After a parameter, a literal is as good as a suffix
+      const std::string &suffix = (g.kind == RuleGroup::Literal ? g.prefix : g.suffix);
+      bool hasExtension;
+      std::string extension = extensionOf(suffix, hasExtension);
+      // A suffix like "/Makefile" means the last path component has no extension; one like "file" says nothing
+      if (hasExtension || suffix.find('/') != suffix.npos)
+        groupsByExtension[extension].push_back(index);
+      else
+        groupsWithoutExtension.push_back(index);
+      prefixSuffix++;
+    } else {
+      if (!r->inputMatcher->Regex().ok()) {
+        printf("Invalid rule pattern %s: %s\n", g.regex.c_str(), r->inputMatcher->Regex().error().c_str());
+        continue;
+      }
+      (g.parametric ? parametricGroups : complexGroups).push_back(index);
+    }
+    if (!g.parametric) groupOf[r->inputMatcher.get()] = index;
+    groups.push_back(g);
+  }
+
+  // Pack the complex regexes into sets in rule file order, by the size of their compiled programs
+  std::vector<int> pending;
+  int64_t size = 0, maxSize = std::max<int64_t>(regexBudget / budgetPerInstruction, 1);
+  for (int index : complexGroups) {
+    int64_t programSize = groups[index].rules.front()->inputMatcher->Regex().ProgramSize();
+    if (!pending.empty() && size + programSize > maxSize) {
+      AddPartition(pending);
+      pending.clear();
+      size = 0;
+    }
+    pending.push_back(index);
+    size += programSize;
+  }
+  if (!pending.empty()) AddPartition(pending);
+  if (verbose) printf("PROFILE: %lu rules, %lu unique regexes (%lu literal, %lu prefix/suffix, %lu other in %lu sets)\n", rc, groups.size(), literal, prefixSuffix, complexGroups.size(), partitions.size());
+}
+
+void Matcher::AddPartition(const std::vector<int> &members) {
+  Partition p;
+  p.set.reset(new RE2::Set(rulesetOptions(), RE2::ANCHOR_BOTH));
+  for (int index : members) {
+    p.set->Add(groups[index].regex, NULL);
+  }
+  if (p.set->Compile()) {
+    p.groups = members;
+    partitions.push_back(std::move(p));
+  } else if (members.size() > 1) {
+    // Too big to compile at all; try again in halves
+    std::vector<int> first(members.begin(), members.begin() + members.size() / 2), second(members.begin() + members.size() / 2, members.end());
+    AddPartition(first);
+    AddPartition(second);
+  } else {
+    printf("Rule pattern %s does not fit in the regex budget\n", groups[members[0]].regex.c_str());
+  }
+}
+
+// Matches the path from offset on
+bool Matcher::FullMatch(const RuleGroup &group, const std::string &path, size_t offset, const RE2::Arg *const *args, std::string *arg) const {
+  switch (group.kind) {
+  case RuleGroup::Literal:
+    return path.compare(offset, path.npos, group.prefix) == 0;
+  case RuleGroup::PrefixSuffix: {
+    size_t fixed = offset + group.prefix.size() + group.suffix.size();
+    if (path.size() < fixed + (group.nonEmpty ? 1 : 0) ||
+        path.compare(offset, group.prefix.size(), group.prefix) != 0 ||
+        path.compare(path.size() - group.suffix.size(), group.suffix.size(), group.suffix) != 0)
+      return false;
+    // As in RE2, the wildcard does not match a newline
+    size_t start = offset + group.prefix.size(), length = path.size() - fixed;
+    if (memchr(path.data() + start, '\n', length)) return false;
+    if (group.rules.front()->inputMatcher->CaptureCount() == 1) arg[0].assign(path, start, length);
+    return true;
+  }
+  default:
+    return RE2::FullMatchN(re2::StringPiece(path).substr(offset), group.rules.front()->inputMatcher->Regex(), args, std::min(10, group.rules.front()->inputMatcher->CaptureCount()));
+  }
+}
+
+// Tries the rest of the regex after every way the path starts with the rule's prefix, and expands each combination
+// that matches, in order
+void Matcher::MatchParametric(const RuleGroup &group, const std::string &path, const RE2::Arg *const *args, std::string *arg, std::vector<Expansion> &found) const {
+  Rule *r = group.rules.front();
+  std::vector<std::pair<size_t, size_t>> prefixes;
+  std::vector<size_t> combinations;
+  r->MatchPrefix(path, prefixes);
+  size_t first = found.size();
+  for (const auto &p : prefixes) {
+    if (!FullMatch(group, path, p.first, args, arg)) continue;
+    r->FreeCombinations(p.second, combinations);
+    for (size_t combination : combinations) {
+      Expansion e;
+      e.rule = r;
+      if (r->Expand(arg, combination, e.expansion))
+        found.push_back(std::move(e));
+    }
+  }
+  std::stable_sort(found.begin() + first, found.end(), [](const Expansion &a, const Expansion &b) { return a.expansion.combination < b.expansion.combination; });
+}
+
+// The groups that may match the path, in the order of the rule file. Only the complex ones are certain to match.
+void Matcher::FindCandidates(const std::string &path, std::vector<int> &candidates) const {
+  candidates.clear();
+  auto literal = literalGroups.find(path);
+  if (literal != literalGroups.end()) candidates.insert(candidates.end(), literal->second.begin(), literal->second.end());
+  bool hasExtension;
+  auto byExtension = groupsByExtension.find(extensionOf(path, hasExtension));
+  if (byExtension != groupsByExtension.end()) candidates.insert(candidates.end(), byExtension->second.begin(), byExtension->second.end());
+  candidates.insert(candidates.end(), groupsWithoutExtension.begin(), groupsWithoutExtension.end());
+  candidates.insert(candidates.end(), parametricGroups.begin(), parametricGroups.end());
+  std::vector<int> matches;
+  for (const auto &p : partitions) {
+    matches.clear();
+#ifndef WIN32
+    RE2::Set::ErrorInfo error;
+    if (!p.set->Match(path, &matches, &error) && error.kind == RE2::Set::kOutOfMemory) {
+      // Checking them one by one is slow, but gives the right answer
+      fallbacks++;
+      for (int index : p.groups) {
+        if (RE2::FullMatch(path, groups[index].rules.front()->inputMatcher->Regex())) candidates.push_back(index);
+      }
+      continue;
+    }
+#else
+    p.set->Match(path, &matches);
+#endif
+    for (int m : matches) candidates.push_back(p.groups[m]);
+  }
+  std::sort(candidates.begin(), candidates.end());
+}
+
+void Matcher::ExpandFiles() {
+  RE2::Arg argv[10];
+  const RE2::Arg* args[10] = {&argv[0], &argv[1], &argv[2], &argv[3], &argv[4], &argv[5], &argv[6], &argv[7], &argv[8], &argv[9]};
+  std::string arg[10];
+  for (size_t i = 0; i < 10; i++) {
+    argv[i] = &arg[i];
+  }
+  std::vector<int> candidates;
+  size_t fc = 0, rcm = 0, index;
+  while ((index = next++) < round->size()) {
+    File *f = (*round)[index];
+    fc++;
+    if (!scope.Covers(f->path)) continue;
+    FindCandidates(f->path, candidates);
+    for (int candidate : candidates) {
+      const RuleGroup &group = groups[candidate];
+      rcm++;
+      if (group.parametric) {
+        MatchParametric(group, f->path, args, arg, results[index]);
+        continue;
+      }
+      if (!FullMatch(group, f->path, 0, args, arg))
+        continue;
+
+      for (Rule *r : group.rules) {
+        for (size_t combination = 0; combination < r->CombinationCount(); combination++) {
+          Expansion e;
+          e.rule = r;
+          if (r->Expand(arg, combination, e.expansion))
+            results[index].push_back(std::move(e));
+        }
+      }
+    }
+  }
+  tried += fc;
+  evaluations += rcm;
+}
+
+void Matcher::Worker() {
+  uint64_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(m);
+      start.wait(lock, [&] { return stopping || generation != seen; });
+      if (stopping) return;
+      seen = generation;
+    }
+    ExpandFiles();
+    std::lock_guard<std::mutex> lock(m);
+    if (--busy == 0) done.notify_all();
+  }
+}
+
+void Matcher::Match(std::vector<File *> &files, std::vector<RuleInstance *> &instances, FileMap &fileMap) {
+  std::vector<File *> current;
+  while (!files.empty()) {
+    current.clear();
+    swap(current, files);
+    results.clear();
+    results.resize(current.size());
+    round = &current;
+    next = 0;
+    bool parallel = !threads.empty() && current.size() >= minimumParallelRound;
+    if (parallel) {
+      std::lock_guard<std::mutex> lock(m);
+      busy = threads.size();
+      generation++;
+      start.notify_all();
+    }
+    ExpandFiles();
+    if (parallel) {
+      std::unique_lock<std::mutex> lock(m);
+      done.wait(lock, [this] { return busy == 0; });
+    }
+    // New files go into files, to be matched in the next round
+    for (size_t i = 0; i < current.size(); i++) {
+      for (const auto &e : results[i]) {
+        e.rule->Apply(current[i], e.expansion, instances, fileMap, files);
+      }
+    }
+  }
+  round = NULL;
+}
+
+static std::vector<std::string> sortedPaths(const std::unordered_set<File *> &files) {
+  std::vector<std::string> paths;
+  for (File *f : files) paths.push_back(f->path);
+  std::sort(paths.begin(), paths.end());
+  return paths;
+}
+
+// One line per rule instance, sorted, with everything that makes up the instance
+static std::string describeGraph(const std::vector<RuleInstance *> &instances, const std::vector<Rule *> &rules) {
+  std::vector<std::string> lines;
+  for (RuleInstance *ri : instances) {
+    std::stringstream line;
+    line << ri->mainOutput->path << " rule " << (std::find(rules.begin(), rules.end(), ri->rule) - rules.begin()) << " cmd " << ri->Command() << " out";
+    for (const auto &p : sortedPaths(ri->outputs)) line << " " << p;
+    line << " cache";
+    for (const auto &p : sortedPaths(ri->cacheOutputs)) line << " " << p;
+    std::vector<std::string> inputs;
+    for (const auto &in : ri->inputs) inputs.push_back(in.first->path + "=" + std::to_string((int)in.second));
+    std::sort(inputs.begin(), inputs.end());
+    line << " in";
+    for (const auto &in : inputs) line << " " << in;
+    lines.push_back(line.str());
+  }
+  std::sort(lines.begin(), lines.end());
+  std::string out;
+  for (const auto &l : lines) out += l + "\n";
+  return out;
+}
+
+struct SyntheticGraph {
+  std::vector<RuleInstance *> instances;
+  FileMap fileMap;
+  ~SyntheticGraph() {
+    for (RuleInstance *ri : instances) delete ri;
+    for (File *f : fileMap) delete f;
+  }
+  std::vector<File *> AddTree() {
+    std::vector<File *> files;
+    for (int module = 0; module < 12; module++) {
+      for (int n = 0; n < 150; n++) {
+        const char *exts[] = { ".c", ".h", ".txt" };
+        for (const char *ext : exts) {
+          std::string path = "src/mod" + std::to_string(module) + "/file" + std::to_string(n) + ext;
+          files.push_back(fileMap.Insert(new File(path)));
+        }
+      }
+    }
+    return files;
+  }
+};
+
+TEST(parallelMatchingBuildsTheSameGraph) {
+  std::unordered_map<std::string, std::string> noVars;
+  std::vector<Rule *> rules = {
+    new Rule("src/(.*)\\.c", "[src/\\1.h]", "obj/\\1.o [obj/\\1.d]", "cc -c src/\\1.c -o obj/\\1.o", noVars),
+    new Rule("obj/([^/]*)/.*\\.o", "", "lib/\\1.a", "ar rcs lib/\\1.a", noVars),
+    new Rule("lib/.*\\.a", "<src/config.h>", "bin/app", "ld -o bin/app", noVars),
+    new Rule("bin/app", "", "all", "", noVars),
+  };
+  ScanScope scope;
+  for (Rule *r : rules) scope.Add(r->simpleMatcherString);
+
+  // The way files were matched before, one at a time
+  SyntheticGraph reference;
+  std::vector<File *> files = reference.AddTree();
+  {
+    RE2::Arg argv[10];
+    const RE2::Arg* args[10] = {&argv[0], &argv[1], &argv[2], &argv[3], &argv[4], &argv[5], &argv[6], &argv[7], &argv[8], &argv[9]};
+    std::string arg[10];
+    for (size_t i = 0; i < 10; i++) argv[i] = &arg[i];
+    while (!files.empty()) {
+      File *f = files.back();
+      files.pop_back();
+      for (Rule *r : rules) {
+        if (RE2::FullMatchN(f->path, r->inputMatcher->Regex(), args, r->inputMatcher->CaptureCount()))
+          r->Match(f, reference.instances, reference.fileMap, files, arg);
+      }
+    }
+  }
+
+  SyntheticGraph serial, parallel;
+  std::vector<File *> serialFiles = serial.AddTree(), parallelFiles = parallel.AddTree();
+  {
+    Matcher matcher(scope, 1);
+    matcher.Compile(rules);
+    matcher.Match(serialFiles, serial.instances, serial.fileMap);
+  }
+  {
+    Matcher matcher(scope, 4);
+    matcher.Compile(rules);
+    matcher.Match(parallelFiles, parallel.instances, parallel.fileMap);
+  }
+
+  std::string expected = describeGraph(reference.instances, rules), fromSerial = describeGraph(serial.instances, rules), fromParallel = describeGraph(parallel.instances, rules);
+  for (Rule *r : rules) delete r;
+  ASSERT_EQ(reference.instances.size(), 12 * 150 + 12 + 2);
+  ASSERT_STREQ(fromSerial, expected);
+  ASSERT_STREQ(fromParallel, expected);
+  ASSERT_EQ(parallel.instances.size(), serial.instances.size());
+  for (size_t i = 0; i < serial.instances.size(); i++) {
+    ASSERT_STREQ(parallel.instances[i]->mainOutput->path, serial.instances[i]->mainOutput->path);
+  }
+}
+
+TEST(fastPathsMatchLikeRegexes) {
+  std::unordered_map<std::string, std::string> noVars;
+  const char *patterns[] = { "Rulefile", "src/(.*)\\.c", "(.*)\\.h", "(.+)/Makefile", "docs/.*", "lib(.*)", "src/[a-m].*\\.c", "a\\+b", "x+y", "(.*)\\.tar\\.gz", "(.*)e" };
+  std::vector<Rule *> rules;
+  for (const char *p : patterns) {
+    std::string n = std::to_string(rules.size());
+    bool capture = (strchr(p, '(') != NULL);
+    rules.push_back(new Rule(p, "", "out" + n + "/" + (capture ? "\\1" : "x"), "cmd " + n + (capture ? " \\1" : ""), noVars));
+  }
+  const char *paths[] = { "Rulefile", "src/Rulefile", "src/main.c", "src/.c", "src/sub/zed.c", "x.h", ".h", "include/a.b.h", "Makefile", "a/Makefile",
+                          "a/Makefile.in", "docs/", "docs/x/y", "lib", "libfoo.a", "a+b", "xxy", "y", "pkg-1.0.tar.gz", "src/lib.h" };
+  ScanScope scope;
+  for (Rule *r : rules) scope.Add(r->simpleMatcherString);
+
+  SyntheticGraph reference, matched;
+  std::vector<File *> files;
+  for (const char *p : paths) files.push_back(reference.fileMap.Insert(new File(p)));
+  RE2::Arg argv[10];
+  const RE2::Arg* args[10] = {&argv[0], &argv[1], &argv[2], &argv[3], &argv[4], &argv[5], &argv[6], &argv[7], &argv[8], &argv[9]};
+  std::string arg[10];
+  for (size_t i = 0; i < 10; i++) argv[i] = &arg[i];
+  for (size_t i = 0; i < files.size(); i++) {
+    File *f = files[i];
+    for (Rule *r : rules) {
+      if (RE2::FullMatchN(f->path, r->inputMatcher->Regex(), args, r->inputMatcher->CaptureCount()))
+        r->Match(f, reference.instances, reference.fileMap, files, arg);
+    }
+  }
+
+  files.clear();
+  for (const char *p : paths) files.push_back(matched.fileMap.Insert(new File(p)));
+  {
+    Matcher matcher(scope, 1);
+    matcher.Compile(rules);
+    matcher.Match(files, matched.instances, matched.fileMap);
+  }
+  std::string expected = describeGraph(reference.instances, rules), actual = describeGraph(matched.instances, rules);
+  for (Rule *r : rules) delete r;
+  ASSERT_STREQ(actual, expected);
+}
+
+TEST(complexRegexesAreSplitOverSetsWithinBudget) {
+  int64_t oldBudget = regexBudget;
+  regexBudget = 256 << 10;
+  std::unordered_map<std::string, std::string> noVars;
+  std::vector<Rule *> rules;
+  for (int n = 0; n < 100; n++) {
+    std::string d = std::to_string(n);
+    rules.push_back(new Rule("dir" + d + "/[a-z]+_(.*)\\.c" + d, "", "out/" + d + "/\\1", "", noVars));
+  }
+  ScanScope scope;
+  for (Rule *r : rules) scope.Add(r->simpleMatcherString);
+  SyntheticGraph graph;
+  std::vector<File *> files;
+  for (int n = 0; n < 100; n += 7) {
+    std::string d = std::to_string(n);
+    std::string paths[] = { "dir" + d + "/abc_x.c" + d, "dir" + d + "/ABC_x.c" + d, "dir" + d + "/abc_x.c" + d + "0" };
+    for (const auto &p : paths) files.push_back(graph.fileMap.Insert(new File(p)));
+  }
+  size_t partitions, fallbacks;
+  {
+    Matcher matcher(scope, 1);
+    matcher.Compile(rules);
+    matcher.Match(files, graph.instances, graph.fileMap);
+    partitions = matcher.PartitionCount();
+    fallbacks = matcher.DfaFallbacks();
+  }
+  regexBudget = oldBudget;
+  for (Rule *r : rules) delete r;
+  bool split = (partitions > 1);
+  ASSERT_EQ(split, true);
+  ASSERT_EQ(fallbacks, 0);
+  ASSERT_EQ(graph.instances.size(), 15);
+}
+
+TEST(eachVariablesInTheLiteralStartBecomeParameters) {
+  boost::filesystem::path ruleFile = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bobtest-%%%%%%%%");
+  FILE *fd = fopen(ruleFile.string().c_str(), "w");
+  fputs("each ARCH: x86 arm\n"
+        "each BUILDTYPE: Debug Release Debug2\n"
+        "src/(.*)\\.c => $(BUILDTYPE)/$(ARCH)/\\1.o\n"
+        "cc \\1\n"
+        "$(BUILDTYPE)/$(ARCH)/.*\\.o => $(BUILDTYPE)/$(ARCH)/app\n"
+        "ld\n"
+        "$(BUILDTYPE)/.*/app => all-$(BUILDTYPE)\n"
+        "\n"
+        "$(ARCH)/x|y => never-$(ARCH)\n"
+        "\n"
+        "endeach\n"
+        "endeach\n", fd);
+  fclose(fd);
+  std::vector<Rule *> parametric;
+  FileMap noFiles;
+  std::vector<File *> noFileList;
+  readFile(parametric, ruleFile.string(), noFiles, noFileList);
+  boost::filesystem::remove(ruleFile);
+
+  // The same rules, copied for every combination
+  std::vector<Rule *> copied;
+  const char *archs[] = { "x86", "arm" }, *buildTypes[] = { "Debug", "Release", "Debug2" };
+  for (const char *arch : archs) {
+    for (const char *buildType : buildTypes) {
+      std::unordered_map<std::string, std::string> localVars = { { "ARCH", arch }, { "BUILDTYPE", buildType } };
+      std::string dir = std::string(buildType) + "/" + arch;
+      copied.push_back(new Rule("src/(.*)\\.c", "", dir + "/\\1.o", "cc \\1", localVars));
+      copied.push_back(new Rule(dir + "/.*\\.o", "", dir + "/app", "ld", localVars));
+      copied.push_back(new Rule(std::string(buildType) + "/.*/app", "", std::string("all-") + buildType, "", localVars));
+      copied.push_back(new Rule(std::string(arch) + "/x|y", "", std::string("never-") + arch, "", localVars));
+    }
+  }
+
+  const char *paths[] = { "src/a.c", "src/b/c.c", "Debug/x86/old.o", "Debug2/arm/z.o", "Release/mips/q.o", "y", "arm/x", "Debug2/x86" };
+  SyntheticGraph reference, matched;
+  std::vector<File *> referenceFiles, matchedFiles;
+  for (const char *p : paths) {
+    referenceFiles.push_back(reference.fileMap.Insert(new File(p)));
+    matchedFiles.push_back(matched.fileMap.Insert(new File(p)));
+  }
+  ScanScope referenceScope, matchedScope;
+  for (Rule *r : copied) referenceScope.Add(r->simpleMatcherString);
+  for (Rule *r : parametric) {
+    for (const auto &regex : r->InputRegexes()) matchedScope.Add(regex);
+  }
+  {
+    Matcher matcher(referenceScope, 1);
+    matcher.Compile(copied);
+    matcher.Match(referenceFiles, reference.instances, reference.fileMap);
+  }
+  {
+    Matcher matcher(matchedScope, 1);
+    matcher.Compile(parametric);
+    matcher.Match(matchedFiles, matched.instances, matched.fileMap);
+  }
+  // Leaving out the rule numbers, as there are fewer rules now
+  std::vector<Rule *> noRules;
+  std::string expected = describeGraph(reference.instances, noRules), actual = describeGraph(matched.instances, noRules);
+  bool variablesMatchOutputs = true;
+  for (RuleInstance *ri : matched.instances) {
+    std::unordered_map<std::string, std::string> v = ri->rule->Variables(ri->combination);
+    if (ri->mainOutput->path.find("all-") == 0 || ri->mainOutput->path.find("never-") == 0) continue;
+    if (ri->mainOutput->path.compare(0, v["BUILDTYPE"].size() + v["ARCH"].size() + 2, v["BUILDTYPE"] + "/" + v["ARCH"] + "/") != 0) variablesMatchOutputs = false;
+  }
+  size_t parametricCount = parametric.size();
+  for (Rule *r : copied) delete r;
+  for (Rule *r : parametric) delete r;
+  ASSERT_STREQ(actual, expected);
+  ASSERT_EQ(variablesMatchOutputs, true);
+  // Only the rule with the alternation is still copied
+  ASSERT_EQ(parametricCount, 3 + 2);
+  ASSERT_EQ(matched.instances.size(), 23);
+}
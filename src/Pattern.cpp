@@ -0,0 +1,89 @@
+#include "Pattern.h"
+#include "Test.h"
+#include <unordered_map>
+
+static std::mutex patternsM;
+static std::unordered_map<std::string, std::weak_ptr<Pattern>> patterns;
+
+// Counts capture groups without compiling: every unescaped ( outside a character class is one. Anything with (? or \Q
+// in it may have named or non-capturing groups, so for those we ask RE2.
+static int countCaptures(const std::string &regex) {
+  if (regex.find("(?") != regex.npos || regex.find("\\Q") != regex.npos)
+    return RE2(regex).NumberOfCapturingGroups();
+  int count = 0;
+  for (size_t i = 0; i < regex.size(); i++) {
+    if (regex[i] == '\\') {
+      i++;
+    } else if (regex[i] == '[') {
+      // A ] right after [ or [^ is part of the class
+      size_t end = i + 1;
+      if (end < regex.size() && regex[end] == '^') end++;
+      if (end < regex.size() && regex[end] == ']') end++;
+      while (end < regex.size() && regex[end] != ']') {
+        if (regex[end] == '\\') end++;
+        end++;
+      }
+      i = end;
+    } else if (regex[i] == '(') {
+      count++;
+    }
+  }
+  return count;
+}
+
+// Reads literal text up to the first regex operator. A character followed by a quantifier is left out, as it is
+// not literal.
+std::string literalRun(const std::string &regex, size_t &pos) {
+  std::string text;
+  while (pos < regex.size()) {
+    char c = regex[pos];
+    size_t length = 1;
+    if (c == '\\') {
+      if (pos + 1 == regex.size() || isalnum((unsigned char)regex[pos + 1])) break;
+      c = regex[pos + 1];
+      length = 2;
+    } else if (strchr(".[]()*+?{}|^$", c)) {
+      break;
+    }
+    if (pos + length < regex.size() && strchr("*+?{", regex[pos + length])) break;
+    text += c;
+    pos += length;
+  }
+  return text;
+}
+
+std::shared_ptr<Pattern> Pattern::Get(const std::string &regex) {
+  std::lock_guard<std::mutex> lock(patternsM);
+  std::weak_ptr<Pattern> &entry = patterns[regex];
+  std::shared_ptr<Pattern> pattern = entry.lock();
+  if (!pattern) {
+    pattern = std::make_shared<Pattern>(regex);
+    entry = pattern;
+  }
+  return pattern;
+}
+
+Pattern::Pattern(const std::string &regex)
+: text(regex)
+, captures(countCaptures(regex))
+{
+}
+
+const RE2 &Pattern::Regex() const {
+  std::call_once(compiled, [this] { regex.reset(new RE2(text)); });
+  return *regex;
+}
+
+TEST(captureCountMatchesRE2) {
+  const char *regexes[] = { "src/(.*)\\.c", "a\\(b", "[(]x", "[]()]", "[^]()]", "[a\\]()]", "(a)(b(c))", "(?:a)(b)", "(?P<n>a)(b)", "\\Q(\\E(a)", "plain" };
+  for (const char *r : regexes) {
+    ASSERT_EQ(Pattern(r).CaptureCount(), RE2(r).NumberOfCapturingGroups());
+  }
+}
+
+TEST(identicalPatternsAreShared) {
+  std::shared_ptr<Pattern> a = Pattern::Get("x/(.*)"), b = Pattern::Get("x/(.*)"), c = Pattern::Get("y/(.*)");
+  bool sameShared = (a.get() == b.get()), differentShared = (a.get() == c.get());
+  ASSERT_EQ(sameShared, true);
+  ASSERT_EQ(differentShared, false);
+}
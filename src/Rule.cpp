@@ -2,67 +2,185 @@
 #include "File.h"
 #include "RuleInstance.h"
 #include "Funcs.h"
+#include <algorithm>
 
-void Rule::Match(File *file, std::vector<RuleInstance*> &rules, std::unordered_map<std::string, File*> &fileMap, std::vector<File *>& files, std::string *arg)
-{
-  try {
-    std::string outputLine = replaceVars(replace_matches(this->outputLine, arg, '\\', inputMatcher.NumberOfCapturingGroups()), localVars);
-    std::vector<std::string> outFiles = split(outputLine, ' ');
-    bool mainOutputIsOptional = (outFiles[0][0] == '[');
-    if (mainOutputIsOptional) {
-      outFiles[0] = outFiles[0].substr(1, outFiles[0].size() - 2);
+// The first parameter varies fastest, so combinations come in the order the copied rules used to
+size_t Rule::CombinationCount() const {
+  size_t count = 1;
+  for (const auto &p : parameters) count *= p.values.size();
+  return count;
+}
+
+size_t Rule::ParameterValue(size_t combination, size_t parameter) const {
+  for (size_t i = 0; i < parameter; i++) combination /= parameters[i].values.size();
+  return combination % parameters[parameter].values.size();
+}
+
+const std::unordered_map<std::string, std::string> &Rule::Variables(size_t combination) const {
+  if (parameters.empty()) return localVars;
+  std::call_once(combinationsMade, [this] {
+    combinationVars.resize(CombinationCount(), localVars);
+    for (size_t c = 0; c < combinationVars.size(); c++) {
+      for (size_t i = 0; i < parameters.size(); i++) {
+        combinationVars[c][parameters[i].name] = parameters[i].values[ParameterValue(c, i)];
+      }
     }
-    File *mainOutputFile = create_file(outFiles[0], fileMap, files);
-    RuleInstance *&rule = mainOutputFile->generatingRule;
-    if (!rule) {
-      rule = new RuleInstance(this);
-      rules.push_back(rule);
-      mainOutputFile->generatingRule = rule;
-      rule->mainOutput = mainOutputFile;
-      if (mainOutputIsOptional) {
-        rule->cacheOutputs.insert(mainOutputFile);
+  });
+  return combinationVars[combination];
+}
+
+std::vector<std::string> Rule::InputRegexes() const {
+  std::vector<std::string> prefixes(1);
+  for (const auto &segment : inputPrefix) {
+    std::vector<std::string> next;
+    for (const auto &prefix : prefixes) {
+      if (segment.parameter < 0) {
+        next.push_back(prefix + RE2::QuoteMeta(segment.text));
       } else {
-        rule->outputs.insert(mainOutputFile);
+        for (const auto &value : parameters[segment.parameter].values) next.push_back(prefix + RE2::QuoteMeta(value));
       }
-      rule->command = replace_matches(command, arg, '\\', inputMatcher.NumberOfCapturingGroups());
+    }
+    swap(prefixes, next);
+  }
+  for (auto &prefix : prefixes) prefix += simpleMatcherString;
+  return prefixes;
+}
 
-      // If our build log is older than the output, it's not the result of that build. Better re-run it to make sure we don't give stale build output.
-      boost::filesystem::path outFile = outFiles[0];
-      boost::filesystem::path logFile = boost::filesystem::path(outFile).parent_path() / (".out." + boost::filesystem::path(outFile).filename().string() + "._");
-      File *logOutputFile = create_file(logFile.string(), fileMap, files);
-      logOutputFile->generatingRule = rule;
-      rule->cacheOutputs.insert(logOutputFile);
+static void matchSegments(const Rule &rule, const std::string &path, size_t segment, size_t pos, std::vector<int> &values, std::vector<std::pair<size_t, size_t>> &matches) {
+  if (segment == rule.inputPrefix.size()) {
+    size_t combination = 0;
+    for (size_t i = rule.parameters.size(); i--;) {
+      combination = combination * rule.parameters[i].values.size() + std::max(values[i], 0);
     }
-    for (size_t idx = 1; idx != outFiles.size(); ++idx) {
-      if (outFiles[idx][0] == '[') {
-        File *file = create_file(outFiles[idx].substr(1, outFiles[idx].size() - 2), fileMap, files);
-        file->generatingRule = rule;
-        rule->cacheOutputs.insert(file);
-      } else {
-        File *file = create_file(outFiles[idx], fileMap, files);
-        file->generatingRule = rule;
-        rule->outputs.insert(file);
+    matches.push_back(std::make_pair(pos, combination));
+    return;
+  }
+  const InputSegment &s = rule.inputPrefix[segment];
+  if (s.parameter < 0) {
+    if (path.compare(pos, s.text.size(), s.text) == 0)
+      matchSegments(rule, path, segment + 1, pos + s.text.size(), values, matches);
+    return;
+  }
+  // One value may be a prefix of another, so every one that fits is tried
+  const std::vector<std::string> &options = rule.parameters[s.parameter].values;
+  int &value = values[s.parameter];
+  for (size_t v = 0; v < options.size(); v++) {
+    if (value >= 0 && (size_t)value != v) continue;
+    if (path.compare(pos, options[v].size(), options[v]) != 0) continue;
+    bool assigned = (value < 0);
+    value = v;
+    matchSegments(rule, path, segment + 1, pos + options[v].size(), values, matches);
+    if (assigned) value = -1;
+  }
+}
+
+void Rule::MatchPrefix(const std::string &path, std::vector<std::pair<size_t, size_t>> &matches) const {
+  matches.clear();
+  std::vector<int> values(parameters.size(), -1);
+  matchSegments(*this, path, 0, 0, values, matches);
+}
+
+void Rule::FreeCombinations(size_t combination, std::vector<size_t> &combinations) const {
+  combinations.clear();
+  if (CombinationCount() == 0) return;
+  combinations.push_back(combination);
+  size_t stride = 1;
+  for (const auto &p : parameters) {
+    if (!p.inInput) {
+      size_t count = combinations.size();
+      for (size_t v = 1; v < p.values.size(); v++) {
+        for (size_t i = 0; i < count; i++) combinations.push_back(combinations[i] + v * stride);
       }
     }
-    rule->inputs[file] = GeneratingInput;
-    file->dependencies.push_back(rule);
+    stride *= p.values.size();
+  }
+  std::sort(combinations.begin(), combinations.end());
+}
 
-    std::vector<std::string> inputs = split(replaceVars(replace_matches(this->inputLine, arg, '\\', inputMatcher.NumberOfCapturingGroups()), localVars), ' ');
-    for (const auto &str : inputs) {
-      File *file;
-      if (str[0] == '[') {
-        file = create_file(str.substr(1, str.size() - 2), fileMap, files);
-        rule->inputs[file] = IndirectInput;
-      } else if (str[0] == '<') {
-        file = create_file(str.substr(1, str.size() - 2), fileMap, files);
-        rule->inputs[file] = BuildBefore;
-      } else {
-        file = create_file(str, fileMap, files);
-        rule->inputs[file] = Input;
-      }
-      file->dependencies.push_back(rule);
+bool Rule::Expand(const std::string *arg, size_t combination, RuleExpansion &expansion) const
+{
+  size_t groups = inputMatcher->CaptureCount();
+  const std::unordered_map<std::string, std::string> &vars = Variables(combination);
+  expansion.combination = combination;
+  std::string buffer;
+  if (outputs.Evaluate(vars, buffer, arg, groups) != Expression::Ok) return false;
+  expansion.outputs = split(buffer, ' ');
+  if (expansion.outputs.empty()) return false;
+  expansion.captures.assign(arg, arg + std::min(groups, commandTemplate.CapturesUsed()));
+  // An input line that fails to expand still leaves the outputs, as it always has
+  buffer.clear();
+  if (inputs.Evaluate(vars, buffer, arg, groups) == Expression::Ok) {
+    expansion.inputs = split(buffer, ' ');
+    expansion.inputsExpanded = true;
+  }
+  return true;
+}
+
+void Rule::Apply(File *file, const RuleExpansion &expansion, std::vector<RuleInstance*> &rules, FileMap &fileMap, std::vector<File *>& files)
+{
+  const std::vector<std::string> &outFiles = expansion.outputs;
+  bool mainOutputIsOptional = (outFiles[0][0] == '[');
+  std::string mainOutput = mainOutputIsOptional ? outFiles[0].substr(1, outFiles[0].size() - 2) : outFiles[0];
+  File *mainOutputFile = create_file(mainOutput, fileMap, files);
+  RuleInstance *&rule = mainOutputFile->generatingRule;
+  if (!rule) {
+    rule = new RuleInstance(this);
+    rules.push_back(rule);
+    mainOutputFile->generatingRule = rule;
+    rule->mainOutput = mainOutputFile;
+    if (mainOutputIsOptional) {
+      rule->cacheOutputs.insert(mainOutputFile);
+    } else {
+      rule->outputs.insert(mainOutputFile);
+    }
+    rule->captures = expansion.captures;
+    rule->combination = expansion.combination;
+
+    // If our build log is older than the output, it's not the result of that build. Better re-run it to make sure we don't give stale build output.
+    boost::filesystem::path outFile = mainOutput;
+    boost::filesystem::path logFile = boost::filesystem::path(outFile).parent_path() / (".out." + boost::filesystem::path(outFile).filename().string() + "._");
+    File *logOutputFile = create_file(logFile.string(), fileMap, files);
+    logOutputFile->generatingRule = rule;
+    rule->cacheOutputs.insert(logOutputFile);
+  }
+  for (size_t idx = 1; idx != outFiles.size(); ++idx) {
+    if (outFiles[idx][0] == '[') {
+      File *file = create_file(outFiles[idx].substr(1, outFiles[idx].size() - 2), fileMap, files);
+      file->generatingRule = rule;
+      rule->cacheOutputs.insert(file);
+    } else {
+      File *file = create_file(outFiles[idx], fileMap, files);
+      file->generatingRule = rule;
+      rule->outputs.insert(file);
+    }
+  }
+  rule->inputs[file] = GeneratingInput;
+  file->dependencies.push_back(rule);
+
+  if (!expansion.inputsExpanded) return;
+  for (const auto &str : expansion.inputs) {
+    File *file;
+    if (str[0] == '[') {
+      file = create_file(str.substr(1, str.size() - 2), fileMap, files);
+      rule->inputs[file] = IndirectInput;
+    } else if (str[0] == '<') {
+      file = create_file(str.substr(1, str.size() - 2), fileMap, files);
+      rule->inputs[file] = BuildBefore;
+    } else {
+      file = create_file(str, fileMap, files);
+      rule->inputs[file] = Input;
     }
-  } catch (int) {}
+    file->dependencies.push_back(rule);
+  }
 }
 
+// For rules without an inputPrefix, once arg holds what the file matched
+void Rule::Match(File *file, std::vector<RuleInstance*> &rules, FileMap &fileMap, std::vector<File *>& files, std::string *arg)
+{
+  for (size_t combination = 0; combination < CombinationCount(); combination++) {
+    RuleExpansion expansion;
+    if (Expand(arg, combination, expansion))
+      Apply(file, expansion, rules, fileMap, files);
+  }
+}
 
@@ -6,100 +6,47 @@
 #include "File.h"
 #include "Funcs.h"
 #include "Rule.h"
+#include "Arena.h"
+#include "Graph.h"
+#include "Depfile.h"
+#include "Snapshot.h"
+#include "Scan.h"
+#include "re2/set.h"
 #include <unistd.h>
 #include <errno.h>
+#include "Test.h"
 
-bool Comparer::operator()(RuleInstance* first, RuleInstance* second) {
-  return first->GetDelay() < second->GetDelay();
+void *RuleInstance::operator new(size_t size) {
+  return Arena<RuleInstance>::Allocate(size);
 }
 
-uint64_t RuleInstance::GetDelay() const {
-  if (cachedDelay == 0) {
-    cachedDelay = runningAverageTimeTaken.count(); // Only for if there's a cycle
-    uint64_t curDelay = 0;
-    for (auto& out : outputs) {
-      for (auto& dep : out->dependencies) {
-        if (dep->wantToRun && dep->somethingToDo)
-          if (dep->GetDelay() > curDelay) curDelay = dep->GetDelay();
-      }
-    }
-    cachedDelay = curDelay + runningAverageTimeTaken.count();
-  }
-  return cachedDelay;
+void RuleInstance::operator delete(void *instance, size_t size) {
+  Arena<RuleInstance>::Release(instance, size);
 }
 
-void RuleInstance::Invalidate() {
-  somethingToDo = true;
-  mainOutput->Invalidate();
-  for (File *f : outputs) {
-    f->Invalidate();
+void RuleInstance::RecordDependencyFiles(const RE2::Set &patterns, const Graph &g, DepsLog &log) {
+  std::vector<int> matches;
+  std::vector<char> buffer;
+  std::vector<File *> outputs(cacheOutputs.begin(), cacheOutputs.end());
+  for (uint32_t e = g.outputStart[id]; e != g.outputStart[id + 1]; e++) {
+    outputs.push_back(g.files[g.outputFile[e]]);
   }
-}
-
-void RuleInstance::Check() {
-  if (verbose) printf("check for %s ?\n", mainOutput->path.c_str());
-  if (command.empty()) {
-    if (verbose) printf("Rebuilding; pseudotarget\n");
-    Invalidate();
-    return;
-  }
-
   for (File *f : outputs) {
-    if (!boost::filesystem::is_regular_file(f->path)) {
-      Invalidate();
-      if (verbose) printf("output %s does not exist\n", f->path.c_str());
-      return;
-    }
-  }
-
-  std::time_t youngestInput = 0;
-  for (const auto &p : inputs) {
-    if (p.second == BuildBefore) 
-      continue;
-    if (!boost::filesystem::is_regular_file(p.first->path)) {
-      if (verbose) printf("input %s does not exist\n", p.first->path.c_str());
-      Invalidate();
-      return;
-    }
-    youngestInput = std::max(youngestInput, p.first->timestamp());
-  }
-
-  std::time_t oldestOutput = getOldestOutput();
-  if (oldestOutput < youngestInput) {
-    if (verbose) printf("oldest output is older than the newest input\n");
-    Invalidate();
-    return;
+    std::vector<DepfileRule> rules;
+    uint64_t lastWrite = lastWriteStamp(f->path);
+    if (lastWrite && patterns.Match(f->path, &matches) && readDepfile(f->path, rules, buffer))
+      log.Record(f->path, lastWrite, rules);
   }
-
-  if (storedRv) {
-    if (verbose) printf("last build was not successful; have to rebuild\n");
-    Invalidate();
-    return;
-  }
-
-  if (verbose) printf("not rebuilding, all inputs up to date and no error on last run\n");
 }
 
-std::time_t RuleInstance::getOldestOutput() {
-  std::time_t oldestOutput = 0;
-
-  for (File *f : outputs) {
-    std::time_t t = f->timestamp();
-    if (oldestOutput == 0 || (t != 0 && oldestOutput > t)) 
-      oldestOutput = t;
-  }
-  return oldestOutput;
+std::string RuleInstance::Command() const {
+  std::string command;
+  rule->commandTemplate.Fill(command, captures.data(), captures.size());
+  return command;
 }
 
-bool RuleInstance::CanRun() {
-  if (!wantToRun) return false;
-  for (const auto &p : inputs) {
-    if (p.first->shouldRebuild) {
-      return false;
-    }
-  }
-  wantToRun = false;
-  return true;
+bool RuleInstance::IsPseudoTarget() const {
+  return rule->command.empty();
 }
 
 static int execute_command(const std::string &cmd, const std::string &outfile = "") {
@@ -125,106 +72,150 @@ static int execute_command(const std::string &cmd, const std::string &outfile =
 }
 
 bool RuleInstance::Run(std::mutex& m) {
-  if (command.empty()) {
+  if (IsPseudoTarget()) {
     // Allow for pseudotargets
     return false;
   }
 
-  try {
-    std::unordered_map<std::string, std::string> vars = rule->localVars;
-    std::string cmd = command;
-    vars["OUTPUT"] = mainOutput->path;
-    std::string out;
-    for (const auto &p : outputs) {
-      out += " " + p->path;
+  std::unordered_map<std::string, std::string> vars = rule->Variables(combination);
+  std::string cmd = Command();
+  vars["OUTPUT"] = mainOutput->path;
+  std::string out;
+  for (uint32_t e = graph.outputStart[id]; e != graph.outputStart[id + 1]; e++) {
+    out += " " + graph.files[graph.outputFile[e]]->path;
+  }
+  vars["OUTPUTS"] = out;
+  std::string in = "";
+  std::string inChanged = "";
+  std::time_t oldestOutput = graph.OldestOutput(id);
+  for (uint32_t e = graph.inputStart[id]; e != graph.inputStart[id + 1]; e++) {
+    if (graph.inputRelation[e] == GeneratingInput ||
+        graph.inputRelation[e] == Input) {
+      const std::string &path = graph.files[graph.inputFile[e]]->path;
+      if (graph.Timestamp(graph.inputFile[e]) > oldestOutput)
+        inChanged += " " + path;
+      in += " " + path;
     }
-    vars["OUTPUTS"] = out;
-    std::string in = "";
-    std::string inChanged = "";
-    std::time_t oldestOutput = getOldestOutput();
-    for (const auto &p : inputs) {
-      if (p.second == GeneratingInput ||
-          p.second == Input) {
-        if (p.first->timestamp() > oldestOutput)
-          inChanged += " " + p.first->path;
-        in += " " + p.first->path;
-      }
+  }
+  vars["INPUTS"] = in;
+  vars["NEW_INPUTS"] = inChanged;
+
+  replace_all(cmd, "$@", mainOutput->path);
+  replace_all(cmd, "$^", in);
+
+  std::string expanded;
+  if (Expression(cmd).Evaluate(vars, expanded) != Expression::Ok) return false;
+  cmd.swap(expanded);
+  int rv;
+  if (verbose && graph.somethingToDo[id]) {
+    std::lock_guard<std::mutex> lock(m);
+    printf("Building %s by running:\n%s\n", mainOutput->path.c_str(), cmd.c_str());
+  } else if (dryrun && graph.somethingToDo[id]) {
+    std::lock_guard<std::mutex> lock(m);
+    printf("Building %s\n", mainOutput->path.c_str());
+  }
+
+  boost::filesystem::path logFile = boost::filesystem::path(mainOutput->path).parent_path() / (".out." + boost::filesystem::path(mainOutput->path).filename().string() + "._");
+  if (dryrun) {
+    rv = 0;
+  } else if (graph.somethingToDo[id]) {
+    for (uint32_t e = graph.outputStart[id]; e != graph.outputStart[id + 1]; e++) {
+      boost::filesystem::path folder = boost::filesystem::path(graph.files[graph.outputFile[e]]->path).parent_path();
+      if (!folder.empty()) boost::filesystem::create_directories(folder);
     }
-    vars["INPUTS"] = in;
-    vars["NEW_INPUTS"] = inChanged;
-
-    replace_all(cmd, "$@", mainOutput->path);
-    replace_all(cmd, "$^", in);
-
-    cmd = replaceVars(cmd, vars);
-    int rv;
-    if (verbose && somethingToDo) {
-      std::lock_guard<std::mutex> lock(m);
-      printf("Building %s by running:\n%s\n", mainOutput->path.c_str(), cmd.c_str());
-    } else if (dryrun && somethingToDo) {
-      std::lock_guard<std::mutex> lock(m);
-      printf("Building %s\n", mainOutput->path.c_str());
+    for (File *f : cacheOutputs) {
+      boost::filesystem::path folder = boost::filesystem::path(f->path).parent_path();
+      if (!folder.empty()) boost::filesystem::create_directories(folder);
     }
-
-    boost::filesystem::path logFile = boost::filesystem::path(mainOutput->path).parent_path() / (".out." + boost::filesystem::path(mainOutput->path).filename().string() + "._");
-    if (dryrun) {
-      rv = 0;
-    } else if (somethingToDo) {
-      for (File *f : outputs) {
-        boost::filesystem::path folder = boost::filesystem::path(f->path).parent_path();
-        if (!folder.empty()) boost::filesystem::create_directories(folder);
-      }
-      for (File *f : cacheOutputs) {
-        boost::filesystem::path folder = boost::filesystem::path(f->path).parent_path();
-        if (!folder.empty()) boost::filesystem::create_directories(folder);
-      }
-      std::chrono::high_resolution_clock::time_point before = std::chrono::high_resolution_clock::now();
-      storedRv = rv = execute_command(cmd, logFile.string());
-      std::chrono::high_resolution_clock::time_point after = std::chrono::high_resolution_clock::now();
-      if (runCount == 10) {
-        runningAverageTimeTaken *= 0.9;
-        runCount--;
-      }
-      runningAverageTimeTaken += (after - before);
-      runCount++;
-    } else {
-      rv = storedRv;
-      if (verbose) printf("using stored rv %d for %s\n", storedRv, mainOutput->path.c_str());
+    std::chrono::high_resolution_clock::time_point before = std::chrono::high_resolution_clock::now();
+    storedRv = rv = execute_command(cmd, logFile.string());
+    std::chrono::high_resolution_clock::time_point after = std::chrono::high_resolution_clock::now();
+    if (runCount == 10) {
+      runningAverageTimeTaken *= 0.9;
+      runCount--;
     }
+    runningAverageTimeTaken += (after - before);
+    runCount++;
+  } else {
+    rv = storedRv;
+    if (verbose) printf("using stored rv %d for %s\n", storedRv, mainOutput->path.c_str());
+  }
 
-    {
-      std::lock_guard<std::mutex> lock(m);
-      if (rv) {
-        printf("Error %d building %s: \n", rv, mainOutput->path.c_str());
-      } else if (verbose && somethingToDo) {
-        printf("Built %s successfully\n", mainOutput->path.c_str());
-        for (File *f : outputs) {
-          if (!boost::filesystem::is_regular_file(f->path)) {
-            printf("Rule did not result in actual output file after successful run: %s => %s\n", in.c_str(), f->path.c_str());
-          }
-        }
-        for (File *f : cacheOutputs) {
-          if (!boost::filesystem::is_regular_file(f->path)) {
-            printf("Rule did not result in actual output file after successful run: %s => %s\n", in.c_str(), f->path.c_str());
-          }
+  {
+    std::lock_guard<std::mutex> lock(m);
+    if (rv) {
+      printf("Error %d building %s: \n", rv, mainOutput->path.c_str());
+    } else if (verbose && graph.somethingToDo[id]) {
+      printf("Built %s successfully\n", mainOutput->path.c_str());
+      for (uint32_t e = graph.outputStart[id]; e != graph.outputStart[id + 1]; e++) {
+        const std::string &path = graph.files[graph.outputFile[e]]->path;
+        if (!boost::filesystem::is_regular_file(path)) {
+          printf("Rule did not result in actual output file after successful run: %s => %s\n", in.c_str(), path.c_str());
         }
-      } else if (boost::filesystem::is_regular_file(logFile) && !boost::filesystem::is_empty(logFile)) {
-        printf("While building %s\n", mainOutput->path.c_str());
       }
-      if (boost::filesystem::is_regular_file(logFile) && !boost::filesystem::is_empty(logFile)) {
-        system(("cat " + logFile.string()).c_str());
+      for (File *f : cacheOutputs) {
+        if (!boost::filesystem::is_regular_file(f->path)) {
+          printf("Rule did not result in actual output file after successful run: %s => %s\n", in.c_str(), f->path.c_str());
+        }
       }
+    } else if (boost::filesystem::is_regular_file(logFile) && !boost::filesystem::is_empty(logFile)) {
+      printf("While building %s\n", mainOutput->path.c_str());
     }
-    if (somethingToDo && rv == 0) {
-      std::lock_guard<std::mutex> lock(runnableM);
-      for (File *f : outputs) {
-        f->SignalRebuilt();
-      }
+    if (boost::filesystem::is_regular_file(logFile) && !boost::filesystem::is_empty(logFile)) {
+      system(("cat " + logFile.string()).c_str());
     }
-    somethingToDo = false;
-    return (rv != 0);
-  } catch (int) { 
-    return false;
   }
+  if (graph.somethingToDo[id] && rv == 0 && !dryrun) {
+    RecordDependencyFiles(depfiles, graph, depsLog);
+  }
+  if (graph.somethingToDo[id] && rv == 0) {
+    std::lock_guard<std::mutex> lock(runnableM);
+    for (uint32_t e = graph.outputStart[id]; e != graph.outputStart[id + 1]; e++) {
+      graph.SignalRebuilt(graph.outputFile[e]);
+    }
+  }
+  graph.somethingToDo[id] = false;
+  return (rv != 0);
 }
 
+
+TEST(dependencyFilesAmongOutputsAreRecorded) {
+  boost::filesystem::path old = boost::filesystem::current_path();
+  boost::filesystem::path root = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bobtest-%%%%%%%%");
+  boost::filesystem::create_directories(root / "obj");
+  boost::filesystem::current_path(root);
+  FILE *f = fopen("obj/a.d", "w");
+  fputs("obj/a.o: src/a.c include/a.h\n", f);
+  fclose(f);
+
+  FileMap fileMap;
+  std::vector<File *> files;
+  File *source = create_file("src/a.c", fileMap, files);
+  File *object = create_file("obj/a.o", fileMap, files);
+  File *depfile = create_file("obj/a.d", fileMap, files);
+  Rule compileRule("src/(.*)\\.c", "", "obj/\\1.o obj/\\1.d", "cc", std::unordered_map<std::string, std::string>());
+  RuleInstance *compile = new RuleInstance(&compileRule);
+  compile->mainOutput = object;
+  compile->outputs.insert(object);
+  compile->outputs.insert(depfile);
+  object->generatingRule = depfile->generatingRule = compile;
+  compile->inputs[source] = GeneratingInput;
+  source->dependencies.push_back(compile);
+  std::vector<RuleInstance *> instances = { compile };
+  Graph g;
+  g.Build(instances, fileMap, DependencyLists());
+  RE2::Set patterns(RE2::Options(), RE2::ANCHOR_BOTH);
+  patterns.Add(".*\\.d", NULL);
+  patterns.Compile();
+  DepsLog log;
+  log.Load(".bob.deps");
+  compile->RecordDependencyFiles(patterns, g, log);
+
+  const DepfileEntry *entry = log.Find("obj/a.d");
+  bool recorded = entry && entry->rules.size() == 1 && entry->rules[0].size() == 3;
+  boost::filesystem::current_path(old);
+  boost::filesystem::remove_all(root);
+  delete compile;
+  for (File *f : files) delete f;
+  ASSERT_EQ(recorded, true);
+}
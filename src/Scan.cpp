@@ -0,0 +1,655 @@
+#include "Scan.h"
+#include "File.h"
+#include "Funcs.h"
+#include "Test.h"
+#include "GitIndex.h"
+#include <boost/filesystem/fstream.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <chrono>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+static uint64_t stampOf(const struct stat &st) {
+  return (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+}
+
+uint64_t lastWriteStamp(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return 0;
+  return stampOf(st);
+}
+
+IgnoreList ignores;
+
+static RE2::Options ignoreOptions() {
+  RE2::Options opts;
+  opts.set_never_capture(true);
+  opts.set_one_line(true);
+  return opts;
+}
+
+IgnoreList::IgnoreList()
+: set(ignoreOptions(), RE2::ANCHOR_BOTH)
+{
+}
+
+void IgnoreList::Add(const std::string &regex, bool negated, bool directoryOnly) {
+  std::string error;
+  if (set.Add(regex, &error) < 0) {
+    printf("Invalid ignore pattern %s: %s\n", regex.c_str(), error.c_str());
+    return;
+  }
+  Pattern p = { negated, directoryOnly };
+  patterns.push_back(p);
+}
+
+void IgnoreList::AddGlob(const std::string &line) {
+  std::string glob = line;
+  while (!glob.empty() && (glob.back() == '\r' || (glob.back() == ' ' && (glob.size() < 2 || glob[glob.size() - 2] != '\\'))))
+    glob.pop_back();
+  if (glob.empty() || glob[0] == '#')
+    return;
+  bool negated = (glob[0] == '!');
+  if (negated)
+    glob = glob.substr(1);
+  else if (glob[0] == '\\' && glob.size() > 1 && (glob[1] == '!' || glob[1] == '#'))
+    glob = glob.substr(1);
+  bool directoryOnly = (!glob.empty() && glob.back() == '/');
+  if (directoryOnly)
+    glob.pop_back();
+  if (glob.empty())
+    return;
+  Add(globToRegex(glob), negated, directoryOnly);
+}
+
+void IgnoreList::Compile() {
+  set.Compile();
+}
+
+bool IgnoreList::IsIgnored(const std::string &path, bool isDirectory) const {
+  if (patterns.empty())
+    return false;
+  std::vector<int> matches;
+  if (!set.Match(path, &matches))
+    return false;
+  int last = -1;
+  for (int m : matches) {
+    if (m > last && (isDirectory || !patterns[m].directoryOnly))
+      last = m;
+  }
+  return last != -1 && !patterns[last].negated;
+}
+
+// Translates a gitignore glob into a regex over the path relative to the build root. A glob with a slash in it
+// (other than a trailing one) is relative to the root, otherwise it matches the name at any depth.
+std::string globToRegex(const std::string &glob) {
+  std::string regex;
+  size_t pos = 0;
+  if (glob.find('/') == glob.npos) {
+    regex = "(?:.*/)?";
+  } else if (glob[0] == '/') {
+    pos = 1;
+  }
+  while (pos < glob.size()) {
+    char c = glob[pos];
+    if (c == '*' && pos + 1 < glob.size() && glob[pos + 1] == '*') {
+      bool atStart = (pos == 0 || glob[pos - 1] == '/');
+      if (atStart && pos + 2 < glob.size() && glob[pos + 2] == '/') {
+        regex += "(?:.*/)?";
+        pos += 3;
+      } else {
+        regex += ".*";
+        pos += 2;
+      }
+    } else if (c == '*') {
+      regex += "[^/]*";
+      pos++;
+    } else if (c == '?') {
+      regex += "[^/]";
+      pos++;
+    } else if (c == '[' && glob.find(']', pos + 2) != glob.npos) {
+      size_t end = glob.find(']', pos + 2);
+      std::string cls = glob.substr(pos + 1, end - pos - 1);
+      if (cls[0] == '!') cls[0] = '^';
+      regex += "[" + cls + "]";
+      pos = end + 1;
+    } else if (c == '\\' && pos + 1 < glob.size()) {
+      regex += RE2::QuoteMeta(glob.substr(pos + 1, 1));
+      pos += 2;
+    } else {
+      regex += RE2::QuoteMeta(glob.substr(pos, 1));
+      pos++;
+    }
+  }
+  return regex;
+}
+
+ScanScope scanScope;
+bool useGitIndex = true;
+
+// Returns the literal text that every match of the regex starts with. isLiteral is set if the regex is only that text.
+std::string literalPrefix(const std::string &regex, bool &isLiteral) {
+  isLiteral = false;
+  int depth = 0;
+  for (size_t i = 0; i < regex.size(); i++) {
+    if (regex[i] == '\\') i++;
+    else if (regex[i] == '(') depth++;
+    else if (regex[i] == ')') depth--;
+    else if (regex[i] == '|' && depth == 0) return std::string();
+    else if (regex[i] == '[') {
+      size_t end = regex.find(']', i + 2);
+      if (end == regex.npos) return std::string();
+      i = end;
+    }
+  }
+
+  std::string prefix;
+  size_t pos = 0;
+  while (pos < regex.size()) {
+    char c = regex[pos];
+    if (c == '\\') {
+      if (pos + 1 == regex.size() || isalnum((unsigned char)regex[pos + 1])) break;
+      c = regex[pos + 1];
+      pos += 2;
+    } else if (strchr(".[]()*+?{}|^$", c)) {
+      break;
+    } else {
+      pos++;
+    }
+    // A quantifier makes the character optional, or means the text after it does not follow directly
+    if (pos < regex.size() && strchr("*?{", regex[pos])) return prefix;
+    prefix += c;
+    if (pos < regex.size() && regex[pos] == '+') return prefix;
+  }
+  isLiteral = (pos == regex.size());
+  return prefix;
+}
+
+void ScanScope::Add(const std::string &regex) {
+  bool isLiteral;
+  std::string prefix = literalPrefix(regex, isLiteral);
+  size_t slash = prefix.find_last_of('/');
+  std::string dir = (slash == prefix.npos) ? std::string() : prefix.substr(0, slash);
+  if (isLiteral) {
+    files.insert(prefix);
+    if (!dir.empty()) ancestors.insert(dir);
+  } else if (dir.empty()) {
+    everything = true;
+    return;
+  } else {
+    subtrees.insert(dir);
+  }
+  // Every directory above it has to be read to get there
+  while ((slash = dir.find_last_of('/')) != dir.npos) {
+    dir = dir.substr(0, slash);
+    ancestors.insert(dir);
+  }
+}
+
+bool ScanScope::IsRelevantDirectory(const std::string &dir, bool &covered) const {
+  covered = everything || subtrees.count(dir);
+  return covered || ancestors.count(dir);
+}
+
+bool ScanScope::IsRelevantFile(const std::string &path) const {
+  return everything || files.count(path);
+}
+
+void ScanScope::Directories(std::vector<std::string> &dirs) const {
+  dirs.insert(dirs.end(), subtrees.begin(), subtrees.end());
+  dirs.insert(dirs.end(), ancestors.begin(), ancestors.end());
+}
+
+void ScanScope::Files(std::vector<std::string> &paths) const {
+  paths.insert(paths.end(), files.begin(), files.end());
+}
+
+bool ScanScope::Covers(const std::string &path) const {
+  if (everything || files.count(path)) return true;
+  for (size_t slash = path.find('/'); slash != path.npos; slash = path.find('/', slash + 1)) {
+    if (subtrees.count(path.substr(0, slash))) return true;
+  }
+  return false;
+}
+
+void readIgnoreFile(const std::string &path, uint64_t &hash) {
+  boost::filesystem::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    hash = hash_bytes(line.c_str(), line.size() + 1, hash);
+    ignores.AddGlob(line);
+  }
+}
+
+namespace {
+
+struct PendingDirectory {
+  std::string path;
+  bool covered; // everything below it is in scope, so no need to check entries against the scan scope
+};
+
+// Directories waiting to be read. Pending counts both the queued ones and the ones being read, as reading one can add more.
+class DirectoryQueue {
+public:
+  DirectoryQueue() : pending(0) {}
+  void push(std::string &&dir, bool covered) {
+    std::lock_guard<std::mutex> lock(m);
+    PendingDirectory d = { std::move(dir), covered };
+    queue.push_back(std::move(d));
+    pending++;
+    cv.notify_one();
+  }
+  bool pop(PendingDirectory &dir) {
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [this]{ return !queue.empty() || pending == 0; });
+    if (queue.empty()) return false;
+    dir = std::move(queue.front());
+    queue.pop_front();
+    return true;
+  }
+  void done() {
+    std::lock_guard<std::mutex> lock(m);
+    if (--pending == 0) cv.notify_all();
+  }
+private:
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<PendingDirectory> queue;
+  size_t pending;
+};
+
+// Files are handed over in batches, to keep the locking on the queue out of the way
+static const size_t fileBatchSize = 256;
+
+struct ScanResult {
+  ScanResult() : read(0) {}
+  std::vector<File *> files;
+  std::vector<Directory> dirs;
+  std::vector<std::pair<std::string, DirectoryListing>> listings;
+  size_t read;
+};
+
+struct ScanContext {
+  ScanContext(FileQueue &output, const ScanScope &scope, const IgnoreList &ignores, const GitIndex *index, const DirectoryListings *listings, uint64_t scanStart)
+  : output(output)
+  , scope(scope)
+  , ignores(ignores)
+  , index(index)
+  , listings(listings)
+  , scanStart(scanStart)
+  {
+  }
+  FileQueue &output;
+  const ScanScope &scope;
+  const IgnoreList &ignores;
+  const GitIndex *index;
+  const DirectoryListings *listings;
+  uint64_t scanStart;
+  // Directories in scope that git does not track, by parent; they do not show up when listing the parent from the index
+  std::unordered_map<std::string, std::vector<std::string>> untrackedDirs;
+  // Files the rules name literally, by directory, which are looked up directly as they may be untracked
+  std::unordered_map<std::string, std::vector<std::string>> literalFiles;
+  DirectoryQueue queue;
+};
+
+#ifdef __linux__
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+#endif
+
+}
+
+// Calls f(name, d_type) for every entry in the directory, without stat'ing anything. Closes fd.
+template <typename F>
+static void forEachEntry(int fd, std::vector<uint64_t> &buffer, F f) {
+#ifdef __linux__
+  long count;
+  char *buf = (char *)buffer.data();
+  while ((count = syscall(SYS_getdents64, fd, buf, buffer.size() * sizeof(uint64_t))) > 0) {
+    for (long offset = 0; offset < count;) {
+      linux_dirent64 *ent = (linux_dirent64 *)(buf + offset);
+      f(ent->d_name, ent->d_type);
+      offset += ent->d_reclen;
+    }
+  }
+  close(fd);
+#else
+  (void)buffer;
+  DIR *d = fdopendir(fd);
+  if (!d) {
+    close(fd);
+    return;
+  }
+  while (struct dirent *ent = readdir(d)) {
+    f(ent->d_name, ent->d_type);
+  }
+  closedir(d);
+#endif
+}
+
+// Classifies entries the directory listing did not give a type for, without following symlinks
+static unsigned char entryType(int dirfd, const char *name) {
+  struct stat st;
+  if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return DT_UNKNOWN;
+  if (S_ISREG(st.st_mode)) return DT_REG;
+  if (S_ISDIR(st.st_mode)) return DT_DIR;
+  if (S_ISLNK(st.st_mode)) return DT_LNK;
+  return DT_UNKNOWN;
+}
+
+// Symlinks to files count as files, but symlinks to directories are not followed, which is what the recursive
+// directory iterator used to do.
+static bool linksToFile(int dirfd, const char *name) {
+  struct stat st;
+  return fstatat(dirfd, name, &st, 0) == 0 && S_ISREG(st.st_mode);
+}
+
+static void addEntry(ScanContext &ctx, ScanResult &result, std::string &&path, bool isDirectory, bool covered) {
+  bool childCovered = covered;
+  if (!covered && !(isDirectory ? ctx.scope.IsRelevantDirectory(path, childCovered) : ctx.scope.IsRelevantFile(path)))
+    return;
+  if (ctx.ignores.IsIgnored(path, isDirectory))
+    return;
+  if (isDirectory) {
+    ctx.queue.push(std::move(path), childCovered);
+  } else {
+    result.files.push_back(new File(std::move(path)));
+    if (result.files.size() == fileBatchSize) {
+      ctx.output.Push(std::move(result.files));
+      result.files.clear();
+    }
+  }
+}
+
+static void scanDirectory(ScanContext &ctx, const PendingDirectory &dir, ScanResult &result, std::vector<uint64_t> &buffer) {
+  // Take the timestamp before reading, so anything that changes while we read shows up as a change next time
+  struct stat st;
+  if (stat(dir.path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) return;
+  uint64_t lastWrite = stampOf(st);
+  result.dirs.push_back(Directory(dir.path, lastWrite));
+  std::string prefix = (dir.path == ".") ? std::string() : dir.path + "/";
+
+  if (ctx.listings) {
+    auto it = ctx.listings->find(dir.path);
+    if (it != ctx.listings->end() && it->second.lastWrite == lastWrite) {
+      const DirectoryListing &listing = it->second;
+      for (const auto &name : listing.files) addEntry(ctx, result, prefix + name, false, dir.covered);
+      for (const auto &name : listing.dirs) addEntry(ctx, result, prefix + name, true, dir.covered);
+      for (const auto &name : listing.links) {
+        std::string path = prefix + name;
+        if (linksToFile(AT_FDCWD, path.c_str())) addEntry(ctx, result, std::move(path), false, dir.covered);
+      }
+      return;
+    }
+  }
+
+  if (ctx.index && !dir.covered) {
+    // A directory that has not changed since git wrote its index has the subdirectories git lists, plus whatever was
+    // untracked at that point. Only directories that the walk passes through on its way to what the rules read from
+    // are listed from it; the ones the rules read from are always read. The only files that matter in the former are
+    // the ones rules name literally, and those are looked up on disk, as the index does not list untracked ones.
+    auto it = ctx.index->directories.find(prefix.empty() ? prefix : dir.path);
+    if (it != ctx.index->directories.end() && lastWrite + racyMargin < ctx.index->lastWrite) {
+      auto literal = ctx.literalFiles.find(it->first);
+      if (literal != ctx.literalFiles.end()) {
+        for (const auto &f : literal->second) {
+          if (linksToFile(AT_FDCWD, f.c_str())) addEntry(ctx, result, std::string(f), false, dir.covered);
+        }
+      }
+      for (const auto &d : it->second.dirs) addEntry(ctx, result, std::string(d), true, dir.covered);
+      auto untracked = ctx.untrackedDirs.find(it->first);
+      if (untracked != ctx.untrackedDirs.end()) {
+        for (const auto &d : untracked->second) addEntry(ctx, result, std::string(d), true, dir.covered);
+      }
+      return;
+    }
+  }
+
+  int fd = open(dir.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return;
+  result.read++;
+  DirectoryListing listing;
+  listing.lastWrite = lastWrite;
+  forEachEntry(fd, buffer, [&](const char *name, unsigned char type) {
+    if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+      return;
+    if (type == DT_UNKNOWN)
+      type = entryType(fd, name);
+    if (type == DT_LNK) {
+      listing.links.push_back(name);
+      if (linksToFile(fd, name)) addEntry(ctx, result, prefix + name, false, dir.covered);
+    } else if (type == DT_REG) {
+      listing.files.push_back(name);
+      addEntry(ctx, result, prefix + name, false, dir.covered);
+    } else if (type == DT_DIR) {
+      listing.dirs.push_back(name);
+      addEntry(ctx, result, prefix + name, true, dir.covered);
+    }
+  });
+  // A directory that changed just before we read it may change again within the same timestamp
+  if (ctx.listings && lastWrite + racyMargin < ctx.scanStart)
+    result.listings.push_back(std::make_pair(dir.path, std::move(listing)));
+}
+
+void FileQueue::Push(std::vector<File *> &&batch) {
+  std::unique_lock<std::mutex> lock(m);
+  cv.wait(lock, [this]{ return maxBatches == 0 || batches.size() < maxBatches; });
+  batches.push_back(std::move(batch));
+  cv.notify_all();
+}
+
+bool FileQueue::Pop(std::vector<File *> &batch) {
+  std::unique_lock<std::mutex> lock(m);
+  cv.wait(lock, [this]{ return !batches.empty() || closed; });
+  if (batches.empty()) return false;
+  batch = std::move(batches.front());
+  batches.pop_front();
+  cv.notify_all();
+  return true;
+}
+
+void FileQueue::Close() {
+  std::lock_guard<std::mutex> lock(m);
+  closed = true;
+  cv.notify_all();
+}
+
+size_t scanFiles(FileQueue &queue, std::vector<Directory> &dirs, size_t threadCount, const ScanScope &scope, const IgnoreList &ignores, const GitIndex *index, DirectoryListings *listings) {
+  if (threadCount < 1) threadCount = 1;
+  uint64_t scanStart = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  ScanContext ctx(queue, scope, ignores, index, listings, scanStart);
+  if (index) {
+    std::vector<std::string> scopeDirs;
+    scope.Directories(scopeDirs);
+    for (const auto &d : scopeDirs) {
+      if (index->directories.count(d)) continue;
+      size_t slash = d.find_last_of('/');
+      std::string parent = (slash == d.npos) ? std::string() : d.substr(0, slash);
+      if (index->directories.count(parent)) ctx.untrackedDirs[parent].push_back(d);
+    }
+    std::vector<std::string> scopeFiles;
+    scope.Files(scopeFiles);
+    for (const auto &f : scopeFiles) {
+      size_t slash = f.find_last_of('/');
+      ctx.literalFiles[(slash == f.npos) ? std::string() : f.substr(0, slash)].push_back(f);
+    }
+  }
+  bool rootCovered;
+  scope.IsRelevantDirectory("", rootCovered);
+  ctx.queue.push(".", rootCovered);
+  std::vector<ScanResult> results(threadCount);
+  auto worker = [&ctx, &results](size_t index) {
+    std::vector<uint64_t> buffer(32768);
+    PendingDirectory dir;
+    while (ctx.queue.pop(dir)) {
+      scanDirectory(ctx, dir, results[index], buffer);
+      ctx.queue.done();
+    }
+    if (!results[index].files.empty()) ctx.output.Push(std::move(results[index].files));
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < threadCount; i++) {
+    threads.push_back(std::thread(worker, i));
+  }
+  worker(0);
+  for (auto &t : threads) {
+    t.join();
+  }
+  queue.Close();
+  size_t read = 0;
+  for (auto &r : results) {
+    dirs.insert(dirs.end(), r.dirs.begin(), r.dirs.end());
+    for (auto &l : r.listings) {
+      std::swap((*listings)[l.first], l.second);
+    }
+    read += r.read;
+  }
+  if (listings) {
+    // Directories that were removed, renamed or left out of the scan since are forgotten
+    std::unordered_set<std::string> visited;
+    for (const auto &r : results) {
+      for (const auto &d : r.dirs) visited.insert(d.path);
+    }
+    for (auto it = listings->begin(); it != listings->end();) {
+      if (visited.count(it->first))
+        ++it;
+      else
+        it = listings->erase(it);
+    }
+  }
+  return read;
+}
+
+size_t getFiles(std::vector<File *> &files, std::vector<Directory> &dirs, size_t threadCount, const ScanScope &scope, const IgnoreList &ignores, const GitIndex *index, DirectoryListings *listings) {
+  FileQueue queue(0);
+  size_t read = scanFiles(queue, dirs, threadCount, scope, ignores, index, listings);
+  std::vector<File *> batch;
+  while (queue.Pop(batch)) {
+    files.insert(files.end(), batch.begin(), batch.end());
+  }
+  return read;
+}
+
+TEST(globWithoutSlashMatchesAtAnyDepth) {
+  IgnoreList list;
+  list.AddGlob("node_modules/");
+  list.AddGlob("*.tmp");
+  list.Compile();
+  ASSERT_EQ(list.IsIgnored("node_modules", true), true);
+  ASSERT_EQ(list.IsIgnored("web/node_modules", true), true);
+  ASSERT_EQ(list.IsIgnored("web/node_modules", false), false);
+  ASSERT_EQ(list.IsIgnored("a/b/c.tmp", false), true);
+  ASSERT_EQ(list.IsIgnored("a/b/c.tmpl", false), false);
+}
+
+TEST(globWithSlashIsRelativeToRoot) {
+  IgnoreList list;
+  list.AddGlob("/obj");
+  list.AddGlob("docs/*/out");
+  list.AddGlob("third_party/**/test");
+  list.Compile();
+  ASSERT_EQ(list.IsIgnored("obj", true), true);
+  ASSERT_EQ(list.IsIgnored("src/obj", true), false);
+  ASSERT_EQ(list.IsIgnored("docs/a/out", true), true);
+  ASSERT_EQ(list.IsIgnored("docs/a/b/out", true), false);
+  ASSERT_EQ(list.IsIgnored("third_party/test", true), true);
+  ASSERT_EQ(list.IsIgnored("third_party/x/y/test", true), true);
+}
+
+TEST(lastMatchingGlobWins) {
+  IgnoreList list;
+  list.AddGlob("# comment");
+  list.AddGlob("*.log");
+  list.AddGlob("!keep.log");
+  list.Compile();
+  ASSERT_EQ(list.IsIgnored("build.log", false), true);
+  ASSERT_EQ(list.IsIgnored("sub/keep.log", false), false);
+  ASSERT_EQ(list.IsIgnored("comment", false), false);
+}
+
+TEST(literalPrefixStopsAtFirstWildcard) {
+  bool isLiteral;
+  ASSERT_STREQ(literalPrefix("src/(.*)\\.cpp", isLiteral), "src/");
+  ASSERT_EQ(isLiteral, false);
+  ASSERT_STREQ(literalPrefix("out/Debug\\.x/.*\\.o", isLiteral), "out/Debug.x/");
+  ASSERT_STREQ(literalPrefix("objs?/.*", isLiteral), "obj");
+  ASSERT_STREQ(literalPrefix("a/b|c/d", isLiteral), "");
+  ASSERT_STREQ(literalPrefix("gen/all\\.cat", isLiteral), "gen/all.cat");
+  ASSERT_EQ(isLiteral, true);
+}
+
+TEST(scanScopeOnlyCoversRulePrefixes) {
+  ScanScope scope;
+  scope.Add("src/lib/(.*)\\.c");
+  scope.Add("docs/index\\.md");
+  bool covered;
+  ASSERT_EQ(scope.IsRelevantDirectory("src", covered), true);
+  ASSERT_EQ(covered, false);
+  ASSERT_EQ(scope.IsRelevantDirectory("src/lib", covered), true);
+  ASSERT_EQ(covered, true);
+  ASSERT_EQ(scope.IsRelevantDirectory("src/app", covered), false);
+  ASSERT_EQ(scope.IsRelevantDirectory("docs", covered), true);
+  ASSERT_EQ(covered, false);
+  ASSERT_EQ(scope.IsRelevantFile("docs/index.md"), true);
+  ASSERT_EQ(scope.IsRelevantFile("docs/other.md"), false);
+  ASSERT_EQ(scope.Covers("src/lib/x/y.c"), true);
+  ASSERT_EQ(scope.Covers("src/app/y.c"), false);
+  scope.Add("(.*)\\.c");
+  ASSERT_EQ(scope.Covers("src/app/y.c"), true);
+}
+
+TEST(unchangedDirectoriesAreListedFromThePreviousScan) {
+  boost::filesystem::path old = boost::filesystem::current_path();
+  boost::filesystem::path root = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bobtest-%%%%%%%%");
+  boost::filesystem::create_directories(root / "src");
+  boost::filesystem::current_path(root);
+  fclose(fopen("src/a.c", "w"));
+  struct timeval past[2] = { { time(NULL) - 3600, 0 }, { time(NULL) - 3600, 0 } };
+  utimes("src", past);
+  utimes(".", past);
+  ScanScope scope;
+  scope.Add("(.*)");
+  IgnoreList ignores;
+  ignores.Compile();
+  DirectoryListings listings;
+  std::vector<File *> first, second, third;
+  std::vector<Directory> dirs;
+  size_t readFirst = getFiles(first, dirs, 1, scope, ignores, NULL, &listings);
+  // A new file with the timestamp put back is not seen, which shows the listing was used
+  fclose(fopen("src/b.c", "w"));
+  utimes("src", past);
+  size_t readSecond = getFiles(second, dirs, 1, scope, ignores, NULL, &listings);
+  utimes("src", NULL);
+  listings["src/gone"] = listings["src"];
+  size_t readThird = getFiles(third, dirs, 1, scope, ignores, NULL, &listings);
+
+  boost::filesystem::current_path(old);
+  boost::filesystem::remove_all(root);
+  for (File *f : first) delete f;
+  for (File *f : second) delete f;
+  for (File *f : third) delete f;
+  ASSERT_EQ(readFirst, 2);
+  ASSERT_EQ(readSecond, 0);
+  ASSERT_EQ(second.size(), 1);
+  ASSERT_EQ(readThird, 1);
+  ASSERT_EQ(third.size(), 2);
+  ASSERT_EQ(listings.size(), 2);
+  ASSERT_EQ(listings.count("src/gone"), 0);
+}
@@ -0,0 +1,740 @@
+#include "Snapshot.h"
+#include "File.h"
+#include "Rule.h"
+#include "RuleInstance.h"
+#include "Funcs.h"
+#include "Scan.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <unordered_set>
+#include <chrono>
+#include <sys/time.h>
+#include "Test.h"
+
+// Each file has its own version, so that changing one format does not throw away what the others hold
+static const char snapshotMagic[8] = { 'B', 'O', 'B', 'G', 'R', 'A', 'P', 'H' };
+static const uint32_t snapshotVersion = 3;
+static const char listingMagic[8] = { 'B', 'O', 'B', 'L', 'I', 'S', 'T', 'S' };
+static const uint32_t listingVersion = 3;
+static const char depsMagic[8] = { 'B', 'O', 'B', 'D', 'E', 'P', 'S', 'L' };
+static const uint32_t depsVersion = 3;
+static const char includesMagic[8] = { 'B', 'O', 'B', 'I', 'N', 'C', 'L', 'S' };
+static const uint32_t includesVersion = 3;
+static const uint32_t noInstance = 0xFFFFFFFF;
+
+namespace {
+
+struct Writer {
+  std::string out;
+  void put32(uint32_t v) { out.append((const char *)&v, sizeof(v)); }
+  void put64(uint64_t v) { out.append((const char *)&v, sizeof(v)); }
+  void putString(const std::string &s) { put32(s.size()); out.append(s); }
+};
+
+struct Reader {
+  Reader(const char *p, const char *end) : p(p), end(end), ok(true) {}
+  const char *p, *end;
+  bool ok;
+  uint32_t get32() { uint32_t v = 0; read(&v, sizeof(v)); return v; }
+  uint64_t get64() { uint64_t v = 0; read(&v, sizeof(v)); return v; }
+  std::string getString() {
+    uint32_t len = get32();
+    if (!ok || (size_t)(end - p) < len) { ok = false; return std::string(); }
+    std::string s(p, len);
+    p += len;
+    return s;
+  }
+  void read(void *v, size_t n) {
+    if (!ok || (size_t)(end - p) < n) { ok = false; return; }
+    memcpy(v, p, n);
+    p += n;
+  }
+};
+
+struct InstanceRecord {
+  uint32_t rule;
+  uint32_t mainOutput;
+  uint32_t combination;
+  std::vector<std::string> captures;
+  std::vector<uint32_t> outputs, cacheOutputs;
+  std::vector<std::pair<uint32_t, Relation>> inputs;
+};
+
+struct FileRecord {
+  std::string path;
+  uint32_t generatingRule;
+  std::vector<uint32_t> dependencies;
+};
+
+}
+
+static void writeAll(int fd, const std::string &out) {
+  const char *p = out.data();
+  size_t left = out.size();
+  while (left) {
+    ssize_t written = write(fd, p, left);
+    if (written <= 0) break;
+    p += written;
+    left -= written;
+  }
+}
+
+// Fills in the size after the magic and version, and writes it out
+static void writeFile(const std::string &fileName, Writer &w) {
+  uint64_t size = w.out.size() - sizeof(snapshotMagic) - sizeof(uint32_t);
+  memcpy(&w.out[sizeof(snapshotMagic) + sizeof(uint32_t)], &size, sizeof(size));
+
+  // Overwrite in place rather than write-and-rename; a rename would change the build root's timestamp and
+  // invalidate the snapshot we just wrote. A partial write is caught by the size check on load.
+  int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return;
+  writeAll(fd, w.out);
+  close(fd);
+}
+
+void createStateFiles() {
+  static const char *const names[] = { ".bob.graph", ".bob.dirs", ".bob.deps", ".bob.includes", ".bob.cache" };
+  for (const char *name : names) {
+    int fd = open(name, O_WRONLY | O_CREAT, 0644);
+    if (fd >= 0) close(fd);
+  }
+}
+
+// Decodes and validates the whole snapshot before anything is created, so a corrupt or stale one leaves no trace
+static bool Decode(Reader &r, uint64_t ruleHash, const std::vector<Rule *> &rules, std::vector<FileRecord> &files, std::vector<InstanceRecord> &instances) {
+  char magic[8];
+  r.read(magic, sizeof(magic));
+  if (!r.ok || memcmp(magic, snapshotMagic, sizeof(magic)) != 0) return false;
+  if (r.get32() != snapshotVersion) return false;
+  if (r.get64() != (uint64_t)(r.end - r.p) + 8) return false; // size of the rest of the file, so truncated snapshots are rejected
+  size_t ruleCount = rules.size();
+  if (r.get64() != ruleHash || r.get32() != ruleCount) return false;
+
+  uint32_t dirCount = r.get32();
+  for (uint32_t i = 0; i < dirCount && r.ok; i++) {
+    std::string path = r.getString();
+    uint64_t lastWrite = r.get64();
+    if (!r.ok) return false;
+    if (lastWriteStamp(path) != lastWrite) {
+      if (verbose) printf("Graph snapshot is stale; directory %s changed\n", path.c_str());
+      return false;
+    }
+  }
+
+  uint32_t fileCount = r.get32(), instanceCount = r.get32();
+  if (!r.ok || fileCount > (size_t)(r.end - r.p) || instanceCount > (size_t)(r.end - r.p)) return false;
+  files.resize(fileCount);
+  instances.resize(instanceCount);
+  for (auto &f : files) {
+    f.path = r.getString();
+  }
+  for (auto &i : instances) {
+    i.rule = r.get32();
+    if (i.rule >= ruleCount) return false;
+  }
+  for (auto &i : instances) {
+    i.mainOutput = r.get32();
+    i.combination = r.get32();
+    uint32_t captureCount = r.get32();
+    if (captureCount > 10) return false;
+    for (uint32_t n = 0; n < captureCount && r.ok; n++) {
+      i.captures.push_back(r.getString());
+    }
+    if (i.mainOutput >= fileCount || i.combination >= rules[i.rule]->CombinationCount()) return false;
+    std::vector<uint32_t> *lists[2] = { &i.outputs, &i.cacheOutputs };
+    for (auto list : lists) {
+      uint32_t count = r.get32();
+      for (uint32_t n = 0; n < count && r.ok; n++) {
+        list->push_back(r.get32());
+        if (list->back() >= fileCount) return false;
+      }
+    }
+    uint32_t inputCount = r.get32();
+    for (uint32_t n = 0; n < inputCount && r.ok; n++) {
+      uint32_t id = r.get32();
+      uint32_t relation = r.get32();
+      if (id >= fileCount || relation > GeneratingInput) return false;
+      i.inputs.push_back(std::make_pair(id, (Relation)relation));
+    }
+    if (!r.ok) return false;
+  }
+  for (auto &f : files) {
+    f.generatingRule = r.get32();
+    if (f.generatingRule != noInstance && f.generatingRule >= instanceCount) return false;
+    uint32_t depCount = r.get32();
+    for (uint32_t n = 0; n < depCount && r.ok; n++) {
+      f.dependencies.push_back(r.get32());
+      if (f.dependencies.back() >= instanceCount) return false;
+    }
+  }
+  return r.ok && r.p == r.end;
+}
+
+bool LoadSnapshot(const std::string &fileName, uint64_t ruleHash, std::vector<Rule *> &rules, FileMap &fileMap, std::vector<RuleInstance *> &instances) {
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  Reader r((const char *)map, (const char *)map + st.st_size);
+  std::vector<FileRecord> fileRecords;
+  std::vector<InstanceRecord> instanceRecords;
+  bool valid = Decode(r, ruleHash, rules, fileRecords, instanceRecords);
+  munmap(map, st.st_size);
+  if (!valid) return false;
+
+  std::vector<File *> fileIds;
+  fileIds.reserve(fileRecords.size());
+  for (const auto &fr : fileRecords) {
+    File *file = fileMap.Find(fr.path);
+    if (!file) file = fileMap.Insert(new File(fr.path));
+    fileIds.push_back(file);
+  }
+  std::vector<RuleInstance *> instanceIds;
+  instanceIds.reserve(instanceRecords.size());
+  for (auto &ir : instanceRecords) {
+    RuleInstance *ri = new RuleInstance(rules[ir.rule]);
+    ri->mainOutput = fileIds[ir.mainOutput];
+    ri->combination = ir.combination;
+    swap(ri->captures, ir.captures);
+    for (uint32_t id : ir.outputs) ri->outputs.insert(fileIds[id]);
+    for (uint32_t id : ir.cacheOutputs) ri->cacheOutputs.insert(fileIds[id]);
+    for (const auto &in : ir.inputs) ri->inputs[fileIds[in.first]] = in.second;
+    instanceIds.push_back(ri);
+  }
+  for (size_t n = 0; n < fileRecords.size(); n++) {
+    File *f = fileIds[n];
+    if (fileRecords[n].generatingRule != noInstance)
+      f->generatingRule = instanceIds[fileRecords[n].generatingRule];
+    for (uint32_t id : fileRecords[n].dependencies) f->dependencies.push_back(instanceIds[id]);
+  }
+  instances.insert(instances.end(), instanceIds.begin(), instanceIds.end());
+  return true;
+}
+
+void StoreSnapshot(const std::string &fileName, uint64_t ruleHash, uint64_t scanStart, const std::vector<Directory> &dirs, const std::vector<Rule *> &rules, const FileMap &fileMap, const std::vector<RuleInstance *> &instances) {
+  for (const auto &d : dirs) {
+    if (d.lastWrite + racyMargin > scanStart) {
+      if (verbose) printf("Not storing graph snapshot; directory %s changed too recently\n", d.path.c_str());
+      return;
+    }
+  }
+
+  std::unordered_map<const Rule *, uint32_t> ruleIds;
+  for (const Rule *r : rules) {
+    ruleIds.insert(std::make_pair(r, (uint32_t)ruleIds.size()));
+  }
+  std::unordered_map<const File *, uint32_t> fileIds;
+  for (const File *f : fileMap) {
+    fileIds.insert(std::make_pair(f, (uint32_t)fileIds.size()));
+  }
+  std::unordered_map<const RuleInstance *, uint32_t> instanceIds;
+  for (const RuleInstance *ri : instances) {
+    instanceIds.insert(std::make_pair(ri, (uint32_t)instanceIds.size()));
+  }
+
+  Writer w;
+  w.out.append(snapshotMagic, sizeof(snapshotMagic));
+  w.put32(snapshotVersion);
+  w.put64(0); // patched with the size below
+  w.put64(ruleHash);
+  w.put32(rules.size());
+  w.put32(dirs.size());
+  for (const auto &d : dirs) {
+    w.putString(d.path);
+    w.put64(d.lastWrite);
+  }
+  w.put32(fileMap.size());
+  w.put32(instances.size());
+  for (const File *f : fileMap) {
+    w.putString(f->path);
+  }
+  for (const RuleInstance *ri : instances) {
+    w.put32(ruleIds[ri->rule]);
+  }
+  for (const RuleInstance *ri : instances) {
+    w.put32(fileIds[ri->mainOutput]);
+    w.put32(ri->combination);
+    w.put32(ri->captures.size());
+    for (const auto &c : ri->captures) w.putString(c);
+    const std::unordered_set<File *> *sets[2] = { &ri->outputs, &ri->cacheOutputs };
+    for (auto set : sets) {
+      w.put32(set->size());
+      for (File *f : *set) w.put32(fileIds[f]);
+    }
+    w.put32(ri->inputs.size());
+    for (const auto &in : ri->inputs) {
+      w.put32(fileIds[in.first]);
+      w.put32(in.second);
+    }
+  }
+  for (const File *f : fileMap) {
+    w.put32(f->generatingRule ? instanceIds[f->generatingRule] : noInstance);
+    w.put32(f->dependencies.size());
+    for (RuleInstance *ri : f->dependencies) w.put32(instanceIds[ri]);
+  }
+  writeFile(fileName, w);
+}
+
+bool LoadDirectoryListings(const std::string &fileName, DirectoryListings &listings) {
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  Reader r((const char *)map, (const char *)map + st.st_size);
+  DirectoryListings loaded;
+  char magic[8];
+  r.read(magic, sizeof(magic));
+  bool valid = r.ok && memcmp(magic, listingMagic, sizeof(magic)) == 0 && r.get32() == listingVersion && r.get64() == (uint64_t)(r.end - r.p) + 8;
+  uint32_t dirCount = valid ? r.get32() : 0;
+  for (uint32_t i = 0; i < dirCount && r.ok; i++) {
+    DirectoryListing &listing = loaded[r.getString()];
+    listing.lastWrite = r.get64();
+    std::vector<std::string> *lists[3] = { &listing.files, &listing.dirs, &listing.links };
+    for (auto list : lists) {
+      uint32_t count = r.get32();
+      if (count > (size_t)(r.end - r.p)) r.ok = false;
+      for (uint32_t n = 0; n < count && r.ok; n++) list->push_back(r.getString());
+    }
+  }
+  valid = valid && r.ok && r.p == r.end;
+  munmap(map, st.st_size);
+  if (valid) swap(listings, loaded);
+  return valid;
+}
+
+void StoreDirectoryListings(const std::string &fileName, const DirectoryListings &listings) {
+  Writer w;
+  w.out.append(listingMagic, sizeof(listingMagic));
+  w.put32(listingVersion);
+  w.put64(0); // patched with the size when writing
+  w.put32(listings.size());
+  for (const auto &p : listings) {
+    w.putString(p.first);
+    w.put64(p.second.lastWrite);
+    const std::vector<std::string> *lists[3] = { &p.second.files, &p.second.dirs, &p.second.links };
+    for (auto list : lists) {
+      w.put32(list->size());
+      for (const auto &name : *list) w.putString(name);
+    }
+  }
+  writeFile(fileName, w);
+}
+
+DepsLog depsLog;
+
+enum { pathRecord = 1, depfileRecord = 2 };
+
+uint32_t DepsLog::PathId(const std::string &path, std::string &out) {
+  auto it = pathIds.find(path);
+  if (it != pathIds.end()) return it->second;
+  uint32_t id = paths.size();
+  pathIds.insert(std::make_pair(path, id));
+  paths.push_back(path);
+  Writer w;
+  w.put32(pathRecord);
+  w.putString(path);
+  out += w.out;
+  return id;
+}
+
+static void putEntry(Writer &w, uint32_t depfile, const DepfileEntry &entry) {
+  w.put32(depfileRecord);
+  w.put32(depfile);
+  w.put64(entry.lastWrite);
+  w.put32(entry.rules.size());
+  for (const auto &rule : entry.rules) {
+    w.put32(rule.size());
+    for (uint32_t id : rule) w.put32(id);
+  }
+}
+
+void DepsLog::Load(const std::string &name) {
+  fileName = name;
+  entries.clear();
+  paths.clear();
+  pathIds.clear();
+  pending.clear();
+  records = 0;
+  rewrite = true;
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return;
+
+  Reader r((const char *)map, (const char *)map + st.st_size);
+  char magic[8];
+  r.read(magic, sizeof(magic));
+  r.ok = r.ok && memcmp(magic, depsMagic, sizeof(magic)) == 0 && r.get32() == depsVersion;
+  while (r.ok && r.p != r.end) {
+    uint32_t kind = r.get32();
+    if (kind == pathRecord) {
+      std::string path = r.getString();
+      if (!r.ok) break;
+      pathIds.insert(std::make_pair(path, (uint32_t)paths.size()));
+      paths.push_back(path);
+    } else if (kind == depfileRecord) {
+      uint32_t depfile = r.get32();
+      DepfileEntry entry;
+      entry.lastWrite = r.get64();
+      uint32_t ruleCount = r.get32();
+      if (depfile >= paths.size() || ruleCount > (size_t)(r.end - r.p)) r.ok = false;
+      for (uint32_t i = 0; i < ruleCount && r.ok; i++) {
+        uint32_t count = r.get32();
+        if (count == 0 || count > (size_t)(r.end - r.p)) r.ok = false;
+        entry.rules.push_back(std::vector<uint32_t>(count));
+        for (uint32_t &id : entry.rules.back()) {
+          id = r.get32();
+          if (id >= paths.size()) r.ok = false;
+        }
+      }
+      if (!r.ok) break;
+      entries[paths[depfile]] = entry;
+      records++;
+    } else {
+      r.ok = false;
+    }
+  }
+  munmap(map, st.st_size);
+  // A record cut short by an interrupted run is dropped, and the next flush writes the log anew without it
+  rewrite = !r.ok;
+}
+
+const DepfileEntry *DepsLog::Find(const std::string &depfile) const {
+  auto it = entries.find(depfile);
+  return it == entries.end() ? NULL : &it->second;
+}
+
+const DepfileEntry &DepsLog::Record(const std::string &depfile, uint64_t lastWrite, const std::vector<DepfileRule> &rules) {
+  std::lock_guard<std::mutex> lock(m);
+  DepfileEntry &entry = entries[depfile];
+  entry.lastWrite = lastWrite;
+  entry.rules.clear();
+  for (const auto &rule : rules) {
+    entry.rules.push_back(std::vector<uint32_t>(1, PathId(rule.target, pending)));
+    for (const auto &input : rule.inputs) entry.rules.back().push_back(PathId(input, pending));
+  }
+  Writer w;
+  putEntry(w, PathId(depfile, pending), entry);
+  pending += w.out;
+  records++;
+  return entry;
+}
+
+void DepsLog::Flush() {
+  std::lock_guard<std::mutex> lock(m);
+  if (fileName.empty()) return;
+  bool whole = rewrite || records > 2 * entries.size() + 1024;
+  if (whole) {
+    // Numbers the paths anew, leaving out the ones nothing uses anymore
+    std::vector<std::string> old;
+    old.swap(paths);
+    pathIds.clear();
+    Writer w;
+    w.out.append(depsMagic, sizeof(depsMagic));
+    w.put32(depsVersion);
+    for (auto &p : entries) {
+      for (auto &rule : p.second.rules) {
+        for (uint32_t &id : rule) id = PathId(old[id], w.out);
+      }
+      putEntry(w, PathId(p.first, w.out), p.second);
+    }
+    pending.swap(w.out);
+    records = entries.size();
+    rewrite = false;
+  } else if (pending.empty()) {
+    return;
+  }
+  int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | (whole ? O_TRUNC : O_APPEND), 0644);
+  if (fd >= 0) {
+    writeAll(fd, pending);
+    close(fd);
+  }
+  pending.clear();
+}
+
+IncludeCache includeCache;
+
+void IncludeCache::Load(const std::string &name) {
+  fileName = name;
+  paths.clear();
+  contents.clear();
+  changed = false;
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return;
+
+  Reader r((const char *)map, (const char *)map + st.st_size);
+  char magic[8];
+  r.read(magic, sizeof(magic));
+  bool valid = r.ok && memcmp(magic, includesMagic, sizeof(magic)) == 0 && r.get32() == includesVersion && r.get64() == (uint64_t)(r.end - r.p) + 8;
+  uint32_t pathCount = valid ? r.get32() : 0;
+  for (uint32_t i = 0; i < pathCount && r.ok; i++) {
+    std::string path = r.getString();
+    PathEntry &entry = paths[path];
+    entry.lastWrite = r.get64();
+    entry.hash = r.get64();
+  }
+  uint32_t contentCount = valid ? r.get32() : 0;
+  for (uint32_t i = 0; i < contentCount && r.ok; i++) {
+    std::vector<IncludeDirective> &includes = contents[r.get64()];
+    uint32_t count = r.get32();
+    if (count > (size_t)(r.end - r.p)) r.ok = false;
+    for (uint32_t n = 0; n < count && r.ok; n++) {
+      IncludeDirective include;
+      include.quoted = r.get32() != 0;
+      include.name = r.getString();
+      includes.push_back(include);
+    }
+  }
+  valid = valid && r.ok && r.p == r.end;
+  munmap(map, st.st_size);
+  if (!valid) {
+    paths.clear();
+    contents.clear();
+  }
+}
+
+static bool readWhole(const std::string &path, std::string &text) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return false;
+  }
+  text.resize(st.st_size);
+  size_t got = 0;
+  while (got < text.size()) {
+    ssize_t n = read(fd, &text[got], text.size() - got);
+    if (n <= 0) break;
+    got += n;
+  }
+  close(fd);
+  text.resize(got);
+  return true;
+}
+
+const std::vector<IncludeDirective> *IncludeCache::Includes(const std::string &path) {
+  uint64_t lastWrite = lastWriteStamp(path);
+  if (!lastWrite) return NULL;
+  {
+    std::lock_guard<std::mutex> lock(m);
+    auto it = paths.find(path);
+    if (it != paths.end() && it->second.lastWrite == lastWrite) {
+      auto content = contents.find(it->second.hash);
+      if (content != contents.end()) return &content->second;
+    }
+  }
+  std::string text;
+  if (!readWhole(path, text)) return NULL;
+  uint64_t hash = hash_bytes(text.data(), text.size());
+  bool known;
+  {
+    std::lock_guard<std::mutex> lock(m);
+    known = contents.count(hash) != 0;
+  }
+  std::vector<IncludeDirective> includes;
+  if (!known) parseIncludes(text.data(), text.size(), includes);
+  std::lock_guard<std::mutex> lock(m);
+  PathEntry &entry = paths[path];
+  entry.lastWrite = lastWrite;
+  entry.hash = hash;
+  changed = true;
+  // Entries are never removed while bob runs, so what is returned stays where it is
+  return &contents.insert(std::make_pair(hash, std::move(includes))).first->second;
+}
+
+void IncludeCache::Store() {
+  std::lock_guard<std::mutex> lock(m);
+  if (fileName.empty() || !changed) return;
+  Writer w;
+  w.out.append(includesMagic, sizeof(includesMagic));
+  w.put32(includesVersion);
+  w.put64(0); // patched with the size when writing
+  w.put32(paths.size());
+  std::unordered_set<uint64_t> used;
+  for (const auto &p : paths) {
+    w.putString(p.first);
+    w.put64(p.second.lastWrite);
+    w.put64(p.second.hash);
+    used.insert(p.second.hash);
+  }
+  w.put32(used.size());
+  for (const auto &c : contents) {
+    if (!used.count(c.first)) continue;
+    w.put64(c.first);
+    w.put32(c.second.size());
+    for (const auto &include : c.second) {
+      w.put32(include.quoted);
+      w.putString(include.name);
+    }
+  }
+  writeFile(fileName, w);
+  changed = false;
+}
+
+TEST(depsLogKeepsTheLastRecordForEachDependencyFile) {
+  std::string fileName = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bobdeps-%%%%%%%%")).string();
+  std::vector<DepfileRule> rules(1);
+  rules[0].target = "obj/a.o";
+  rules[0].inputs.push_back("src/a.c");
+  rules[0].inputs.push_back("include/a.h");
+  {
+    DepsLog log;
+    log.Load(fileName);
+    log.Record("obj/a.d", 10, rules);
+    log.Record("obj/b.d", 20, std::vector<DepfileRule>());
+    log.Flush();
+    rules[0].inputs.pop_back();
+    log.Record("obj/a.d", 30, rules);
+    log.Flush();
+  }
+  DepsLog log;
+  log.Load(fileName);
+  const DepfileEntry *a = log.Find("obj/a.d"), *b = log.Find("obj/b.d");
+  bool found = a && b && !log.Find("obj/c.d");
+  ASSERT_EQ(found, true);
+  ASSERT_EQ(a->lastWrite, 30);
+  ASSERT_EQ(a->rules.size(), 1);
+  ASSERT_EQ(a->rules[0].size(), 2);
+  ASSERT_STREQ(log.Path(a->rules[0][0]), "obj/a.o");
+  ASSERT_STREQ(log.Path(a->rules[0][1]), "src/a.c");
+  ASSERT_EQ(b->lastWrite, 20);
+
+  // A record cut short is dropped, and the ones before it kept
+  boost::filesystem::resize_file(fileName, boost::filesystem::file_size(fileName) - 2);
+  log.Load(fileName);
+  a = log.Find("obj/a.d");
+  bool kept = (a != NULL);
+  ASSERT_EQ(kept, true);
+  ASSERT_EQ(a->lastWrite, 10);
+  ASSERT_EQ(a->rules[0].size(), 3);
+  boost::filesystem::remove(fileName);
+}
+
+TEST(snapshotIsReloadedUntilADirectoryChanges) {
+  boost::filesystem::path old = boost::filesystem::current_path();
+  boost::filesystem::path root = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bobtest-%%%%%%%%");
+  boost::filesystem::create_directories(root / "src");
+  std::string fileName = root.string() + ".graph";
+  boost::filesystem::current_path(root);
+  fclose(fopen("src/a.c", "w"));
+  struct timeval past[2] = { { time(NULL) - 3600, 0 }, { time(NULL) - 3600, 0 } };
+  utimes("src", past);
+  utimes(".", past);
+  ScanScope scope;
+  scope.Add("src/(.*)\\.c");
+  IgnoreList ignores;
+  ignores.Compile();
+  std::vector<File *> files;
+  std::vector<Directory> dirs;
+  getFiles(files, dirs, 1, scope, ignores, NULL, NULL);
+  FileMap fileMap;
+  for (File *f : files) fileMap.Insert(f);
+  Rule compileRule("src/(.*)\\.c", "", "obj/\\1.o", "cc", std::unordered_map<std::string, std::string>());
+  std::vector<Rule *> rules = { &compileRule };
+  File *source = fileMap.Find("src/a.c");
+  RuleInstance *compile = new RuleInstance(&compileRule);
+  compile->mainOutput = create_file("obj/a.o", fileMap, files);
+  compile->outputs.insert(compile->mainOutput);
+  compile->mainOutput->generatingRule = compile;
+  compile->inputs[source] = GeneratingInput;
+  source->dependencies.push_back(compile);
+  std::vector<RuleInstance *> instances = { compile };
+  uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  StoreSnapshot(fileName, 42, now, dirs, rules, fileMap, instances);
+
+  FileMap loadedMap;
+  std::vector<RuleInstance *> loaded;
+  bool reloaded = LoadSnapshot(fileName, 42, rules, loadedMap, loaded);
+  File *object = loadedMap.Find("obj/a.o");
+  bool sameGraph = reloaded && loaded.size() == 1 && object && object->generatingRule == loaded[0] &&
+                   loaded[0]->inputs.size() == 1 && loaded[0]->inputs.begin()->first == loadedMap.Find("src/a.c");
+  FileMap otherMap;
+  std::vector<RuleInstance *> other;
+  bool otherRules = LoadSnapshot(fileName, 43, rules, otherMap, other);
+  utimes("src", NULL);
+  bool afterChange = LoadSnapshot(fileName, 42, rules, otherMap, other);
+
+  boost::filesystem::current_path(old);
+  boost::filesystem::remove_all(root);
+  boost::filesystem::remove(fileName);
+  for (RuleInstance *ri : loaded) delete ri;
+  for (File *f : loadedMap) delete f;
+  delete compile;
+  for (File *f : files) delete f;
+  ASSERT_EQ(sameGraph, true);
+  ASSERT_EQ(otherRules, false);
+  ASSERT_EQ(afterChange, false);
+}
+
+TEST(writingStateFilesKeepsTheSnapshotValid) {
+  boost::filesystem::path old = boost::filesystem::current_path();
+  boost::filesystem::path root = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bobtest-%%%%%%%%");
+  boost::filesystem::create_directories(root);
+  boost::filesystem::current_path(root);
+  createStateFiles();
+  struct timeval past[2] = { { time(NULL) - 3600, 0 }, { time(NULL) - 3600, 0 } };
+  utimes(".", past);
+  ScanScope scope;
+  scope.Add("(.*)");
+  IgnoreList ignores;
+  ignores.Compile();
+  std::vector<File *> files;
+  std::vector<Directory> dirs;
+  DirectoryListings listings;
+  getFiles(files, dirs, 1, scope, ignores, NULL, &listings);
+  FileMap fileMap;
+  for (File *f : files) fileMap.Insert(f);
+  std::vector<Rule *> rules;
+  std::vector<RuleInstance *> instances;
+  uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  // Everything a run writes after the scan
+  StoreSnapshot(".bob.graph", 42, now, dirs, rules, fileMap, instances);
+  StoreDirectoryListings(".bob.dirs", listings);
+  DepsLog log;
+  log.Load(".bob.deps");
+  log.Record("obj/a.d", 10, std::vector<DepfileRule>());
+  log.Flush();
+  boost::filesystem::ofstream(".bob.cache") << "cache";
+  boost::filesystem::ofstream(".bob.includes") << "includes";
+
+  FileMap loadedMap;
+  std::vector<RuleInstance *> loaded;
+  bool reused = LoadSnapshot(".bob.graph", 42, rules, loadedMap, loaded);
+  boost::filesystem::current_path(old);
+  boost::filesystem::remove_all(root);
+  for (File *f : loadedMap) delete f;
+  for (File *f : files) delete f;
+  ASSERT_EQ(reused, true);
+}
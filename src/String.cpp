@@ -1,4 +1,6 @@
 #include "Funcs.h"
+#include "Pattern.h"
+#include <algorithm>
 #include <regex>
 #include "Test.h"
 
@@ -56,17 +58,21 @@ size_t find_first_owned_space(const std::string& arg) {
   return arg.npos;
 }
 
-std::string replace_with_pattern(const std::string& item, const RE2& pattern, const std::string& target) {
-  RE2::Arg argv[10];
-  const RE2::Arg* args[10] = {&argv[0], &argv[1], &argv[2], &argv[3], &argv[4], &argv[5], &argv[6], &argv[7], &argv[8], &argv[9]};
-  std::string arg[10];
-  for (size_t i = 0; i < 10; i++) {
-    argv[i] = &arg[i];
-  }
-  if (!RE2::FullMatchN(item, pattern, args, pattern.NumberOfCapturingGroups()))
+std::string replace_with_pattern(const std::string& item, const Pattern& pattern, const std::string& target, CaptureArgs &captures) {
+  int count = std::min(10, pattern.CaptureCount());
+  if (!RE2::FullMatchN(item, pattern.Regex(), captures.args, count))
     return item;
 
-  return replace_matches(target, arg, '@', pattern.NumberOfCapturingGroups());
+  return replace_matches(target, captures.arg, '@', count);
+}
+
+uint64_t hash_bytes(const char *data, size_t length, uint64_t hash) {
+  // FNV-1a; only used for change detection, not for anything adversarial
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
 }
 
 TEST(splitSimpleTest) {
@@ -7,6 +7,12 @@
 #include <thread>
 #include "re2/set.h"
 #include "Profile.h"
+#include "Snapshot.h"
+#include "Scan.h"
+#include "GitIndex.h"
+#include "Matcher.h"
+#include "Graph.h"
+#include "Depfile.h"
 static const int BOB_VERSION = 4;
 
 static const RE2::Options &getopts() {
@@ -18,9 +24,10 @@ static const RE2::Options &getopts() {
   return opts;
 }
 
-std::priority_queue<RuleInstance*, std::vector<RuleInstance*>, Comparer> runnable;
+std::priority_queue<uint32_t, std::vector<uint32_t>, Comparer> runnable;
 std::mutex runnableM;
 RE2::Set depfiles(getopts(), RE2::ANCHOR_BOTH), generateds(getopts(), RE2::ANCHOR_BOTH);
+std::vector<std::string> immutables;
 std::unordered_map<std::string, std::string> vars;
 std::string target = "all";
 bool clean = false;
@@ -41,7 +48,7 @@ struct entry {
   char name[0];
 };
 
-void LoadCache(const std::string &fileName, std::unordered_map<std::string, File *> &fileMap) {
+void LoadCache(const std::string &fileName, FileMap &fileMap) {
   boost::system::error_code error;
   size_t fileSize = boost::filesystem::file_size(fileName, error);
   if (error) return;
@@ -52,8 +59,8 @@ void LoadCache(const std::string &fileName, std::unordered_map<std::string, File
   }
   entry *ent = (entry *)buffer, *end = (entry *)(buffer+fileSize - sizeof(entry));
   while (ent < end) {
-    if (fileMap.find(ent->name) != fileMap.end()) {
-      File *f = fileMap[ent->name];
+    File *f = fileMap.Find(ent->name);
+    if (f) {
       if (f->generatingRule) {
         RuleInstance *r = f->generatingRule;
         r->storedRv = ent->lastBuildResult;
@@ -65,17 +72,32 @@ void LoadCache(const std::string &fileName, std::unordered_map<std::string, File
   }
 }
 
-void StoreCache(const std::string &fileName, std::unordered_map<std::string, File *> &fileMap) {
+// The first entry has no name, and holds how many files the run knew of before pruning in timeTaken. Older
+// versions look that entry up as a file, and find nothing.
+size_t CachedFileCount(const std::string &fileName) {
+  char buffer[sizeof(entry) + 1];
+  boost::filesystem::ifstream fd(fileName);
+  if (!fd.read(buffer, sizeof(buffer))) return 0;
+  entry *ent = (entry *)buffer;
+  return buffer[sizeof(entry)] ? 0 : ent->timeTaken;
+}
+
+void StoreCache(const std::string &fileName, FileMap &fileMap, size_t fileCount) {
   char buffer[2048];
   entry *ent = (entry *)buffer;
   boost::filesystem::ofstream fd(fileName);
-  for (const auto &p : fileMap) {
-    if (p.second->generatingRule) {
-      RuleInstance *r = p.second->generatingRule;
+  ent->lastBuildResult = 0;
+  ent->runCount = 0;
+  ent->timeTaken = fileCount;
+  buffer[sizeof(entry)] = 0;
+  fd.write(buffer, sizeof(entry) + 1);
+  for (File *f : fileMap) {
+    if (f->generatingRule) {
+      RuleInstance *r = f->generatingRule;
       ent->runCount = r->runCount;
       ent->timeTaken = r->runningAverageTimeTaken.count();
       ent->lastBuildResult = r->storedRv;
-      strcpy(ent->name, p.second->path.c_str());
+      strcpy(ent->name, f->path.c_str());
       fd.write(buffer, sizeof(entry) + strlen(ent->name) + 1);
     }
   }
@@ -98,9 +120,8 @@ void runtests() {
 int main(int, char **argv) {
   std::vector<Rule *> rules;
   std::vector<File *> files;
-  std::unordered_map<std::string, File *> fileMap(524287);
+  FileMap fileMap;
   std::vector<RuleInstance *> instances;
-  RE2::Set ruleset(getopts(), RE2::ANCHOR_BOTH);
 
   {
     PROFILE(Initial);
@@ -153,112 +174,136 @@ int main(int, char **argv) {
       exit(0);
     }
   }
+  uint64_t ruleHash = 0;
   {
     PROFILE(reading rule file)
-    if (!readRuleFile(rules, fileMap, files)) {
+    if (!readRuleFile(rules, fileMap, files, ruleHash)) {
       printf("Cannot find Rulefile or bobfile in any parent directory, stopping...\n");
       exit(-1);
     }
   }
-  // Always read rule file first before finding files, as the rule file location determines the root of the build
+  createStateFiles();
+  // Sized for the files the last run had, so that the table does not have to grow while matching
+  fileMap.Reserve(CachedFileCount(".bob.cache"));
+  bool fromSnapshot;
   {
-    PROFILE(reading files)
-    getFiles(files);
+    PROFILE(loading graph snapshot)
+    fromSnapshot = LoadSnapshot(".bob.graph", ruleHash, rules, fileMap, instances);
+    if (fromSnapshot) files.clear();
   }
-  {
-    PROFILE(creating file map)
-    for (File *f : files) { 
-      fileMap[f->path] = f;
+  if (!fromSnapshot) {
+    // Always read rule file first before finding files, as the rule file location determines the root of the build
+    std::vector<Directory> dirs;
+    uint64_t scanStart = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    GitIndex index;
+    bool haveIndex;
+    {
+      PROFILE(reading git index)
+      haveIndex = useGitIndex && readGitIndex(".git/index", index);
+      if (verbose) printf("PROFILE: %s\n", haveIndex ? "listing unchanged directories from .git/index" : "reading all directories");
     }
-  }
-  std::vector<std::pair<std::string, std::vector<Rule *>>> ruleMap;
-  {
-    size_t rc = 0, ris = 0;
-    PROFILE(precompiling regex set)
+    DirectoryListings listings;
+    {
+      PROFILE(loading directory listings)
+      LoadDirectoryListings(".bob.dirs", listings);
+    }
+    size_t listingCount = listings.size();
+    // The scan runs on its own threads and hands over files as it finds them, so that rules are matched while
+    // it is still reading directories
+    FileQueue scanned(64);
+    size_t dirsRead = 0;
+    ignores.Compile();
     for (Rule *r : rules) {
-      rc++;
-      bool found = false;
-      for (auto &p : ruleMap) {
-        if (p.first == r->simpleMatcherString) {
-          p.second.push_back(r);
-          found = true;
-          break;
-        }
-      }
-      if (!found) {
-        ruleMap.push_back(std::pair<std::string, std::vector<Rule *>>(r->simpleMatcherString, std::vector<Rule *>()));
-        ruleMap[ruleMap.size()-1].second.push_back(r);
-        ruleset.Add(r->simpleMatcherString, NULL);
-        ris++;
-      }
+      for (const auto &regex : r->InputRegexes()) scanScope.Add(regex);
     }
-    if (verbose) printf("PROFILE: %lu rules, %lu unique regexes\n", rc, ris);
-    ruleset.Compile();
-  }
-  {
-    PROFILE(matching rules)
-    RE2::Arg argv[10];
-    const RE2::Arg* args[10] = {&argv[0], &argv[1], &argv[2], &argv[3], &argv[4], &argv[5], &argv[6], &argv[7], &argv[8], &argv[9]};
-    std::string arg[10];
-    for (size_t i = 0; i < 10; i++) {
-      argv[i] = &arg[i];
+    std::thread scanner([&] {
+      dirsRead = scanFiles(scanned, dirs, workerCount, scanScope, ignores, haveIndex ? &index : NULL, &listings);
+    });
+    Matcher matcher(scanScope, workerCount);
+    {
+      PROFILE(precompiling regex set)
+      matcher.Compile(rules);
     }
-    size_t fc = 0, rcm = 0;
-    while (true) {
-      fc++;
-      File *f;
-      if (files.empty()) break;
-      f = files.back();
-      files.pop_back();
-      std::vector<int> matchingRules;
-      if (ruleset.Match(f->path, &matchingRules)) {
-        for (int match : matchingRules) {
-          std::vector<Rule *> &mrules = ruleMap[match].second;
-          rcm++;
-          if (!RE2::FullMatchN(f->path, mrules.front()->inputMatcher, args, std::min(10, mrules.front()->inputMatcher.NumberOfCapturingGroups())))
+    {
+      PROFILE(reading files and matching rules)
+      std::vector<File *> batch;
+      while (scanned.Pop(batch)) {
+        for (File *f : batch) {
+          if (fileMap.Insert(f) != f) {
+            // Already created as the output of a rule, and matched as such
+            delete f;
             continue;
-
-          for (Rule *r : mrules) {
-            r->Match(f, instances, fileMap, files, arg);
           }
+          files.push_back(f);
         }
+        matcher.Match(files, instances, fileMap);
       }
+      scanner.join();
+      if (verbose) printf("PROFILE: read %lu of %lu directories from disk\n", dirsRead, dirs.size());
+      if (verbose) printf("PROFILE: tried %lu files to match, %lu regex evaluations, %lu regex sets out of DFA memory\n", matcher.FilesTried(), matcher.RegexEvaluations(), matcher.DfaFallbacks());
+    }
+    if (dirsRead || listings.size() != listingCount) {
+      PROFILE(storing directory listings)
+      StoreDirectoryListings(".bob.dirs", listings);
+    }
+    {
+      PROFILE(storing graph snapshot)
+      StoreSnapshot(".bob.graph", ruleHash, scanStart, dirs, rules, fileMap, instances);
     }
-    if (verbose) printf("PROFILE: tried %lu files to match, %lu regex evaluations\n", fc, rcm);
   }
+  if (target.empty())
+    target = "all";
   // Load dependencies after matching the rules, as only dependencies for valid targets are taken into account
   {
     PROFILE(loading dependency files)
-    depfiles.Compile();
-    for (auto p : fileMap) {
-      loadDependenciesFrom(p.second->path, rules, fileMap, files);
+    std::vector<RuleInstance *> roots;
+    if (clean) {
+      roots = instances;
+    } else {
+      for (const auto &t : split(target, ' ')) {
+        File *f = fileMap.Find(t);
+        if (!f) {
+          printf("Invalid target specified: %s\n", t.c_str());
+          return 1;
+        }
+        if (f->generatingRule) roots.push_back(f->generatingRule);
+      }
     }
+    depfiles.Compile();
+    generateds.Compile();
+    depsLog.Load(".bob.deps");
+    includeCache.Load(".bob.includes");
+    loadReachableDependencies(roots, fileMap, files, workerCount);
+    depsLog.Flush();
+    includeCache.Store();
   }
+  size_t fileCount = fileMap.size();
   // prune files that are irrelevant for building or stale
   {
     PROFILE(pruning irrelevant files)
-    generateds.Compile();
     for (auto it = fileMap.begin(); it != fileMap.end();) {
-      if (it->second->generatingRule == NULL) {
+      File *f = *it;
+      if (f->generatingRule == NULL) {
         std::vector<int> v;
-        if (generateds.Match(it->second->path, &v)) {
+        if (generateds.Match(f->path, &v)) {
           // File is an input, but should have been generated and the source responsible for doing so is now gone
-          if (verbose) printf("Found stale generated output %s that does not have a generating source\n", it->second->path.c_str());
-          for (auto &dep : it->second->dependencies) {
-            dep->inputs.erase(it->second);
+          if (verbose) printf("Found stale generated output %s that does not have a generating source\n", f->path.c_str());
+          for (auto &dep : f->dependencies) {
+            dep->inputs.erase(f);
           }
           if (!dryrun)
-            boost::filesystem::remove(it->second->path);
-          delete it->second;
+            boost::filesystem::remove(f->path);
           it = fileMap.erase(it);
-        } else if (it->second->dependencies.empty()) {
+          delete f;
+        } else if (f->dependencies.empty() && f->lists.empty()) {
           // File is not an input or output
-          delete it->second;
           it = fileMap.erase(it);
-        } else if (!boost::filesystem::is_regular_file(it->second->path)) {
+          delete f;
+        } else if (!boost::filesystem::is_regular_file(f->path)) {
           // File is an input (of sorts), but does not exist and won't be generated
           // Do not print log typically, because dependency files get stale occasionally and this results in scary logging that's not relevant
-          if (verbose) printf("Found non-existant file %s\nrequired to build %s\n", it->second->path.c_str(), it->second->dependencies[0]->mainOutput->path.c_str());
+          RuleInstance *user = f->FirstUser();
+          if (verbose && user) printf("Found non-existant file %s\nrequired to build %s\n", f->path.c_str(), user->mainOutput->path.c_str());
           ++it;
         } else {
           // File is just input
@@ -276,48 +321,49 @@ int main(int, char **argv) {
   bool anyFail = false;
   if (clean) {
     PROFILE(running clean)
-    for (auto p : fileMap) {
-      if (p.second->generatingRule && 
-          boost::filesystem::is_regular_file(p.second->path)) {
+    for (File *f : fileMap) {
+      if (f->generatingRule && 
+          boost::filesystem::is_regular_file(f->path)) {
         if (dryrun || verbose)
-          printf("rm %s\n", p.second->path.c_str());
+          printf("rm %s\n", f->path.c_str());
         if (!dryrun)
-          boost::filesystem::remove(p.second->path);
+          boost::filesystem::remove(f->path);
       }
     }
   } else {
+    {
+      PROFILE(building graph arrays)
+      graph.Build(instances, fileMap, dependencyLists);
+    }
     {
       PROFILE(determining what to build)
-      if (target.empty())
-        target = "all";
-
       std::vector<std::string> targets = split(target, ' ');
-      std::vector<RuleInstance *> toCheck;
+      std::vector<uint32_t> toCheck;
       for (auto t : targets) {
-        File *f = fileMap[t];
+        File *f = fileMap.Find(t);
         if (!f) {
           printf("Invalid target specified: %s\n", t.c_str());
           return 1;
         }
-        if (f->generatingRule)
-          toCheck.push_back(f->generatingRule);
+        if (graph.generator[f->id] != Graph::NoId)
+          toCheck.push_back(graph.generator[f->id]);
       }
       while (!toCheck.empty()) {
-        RuleInstance *r = toCheck.back();
+        uint32_t r = toCheck.back();
         toCheck.pop_back();
-        if (r->wantToRun) 
+        if (graph.wantToRun[r]) 
           continue; // avoid double-checking things; this also breaks loops
-        r->Check();
-        r->wantToRun = true;
-        for (const auto &p : r->inputs)
-          if (p.first->generatingRule) 
-            toCheck.push_back(p.first->generatingRule);
+        graph.Check(r);
+        graph.wantToRun[r] = true;
+        for (uint32_t e = graph.inputStart[r]; e != graph.inputStart[r + 1]; e++)
+          if (graph.generator[graph.inputFile[e]] != Graph::NoId) 
+            toCheck.push_back(graph.generator[graph.inputFile[e]]);
       }
     }
     {
       PROFILE(spawning workers and building)
-      for (RuleInstance *r : instances) {
-        if (r->CanRun()) runnable.push(r);
+      for (uint32_t r = 0; r < graph.instances.size(); r++) {
+        if (graph.CanRun(r)) runnable.push(r);
       }
       std::vector<std::thread*> workers;
       std::mutex outputMutex;
@@ -334,7 +380,7 @@ int main(int, char **argv) {
                 r = NULL;
               } else {
                 if (!r) workersIdle--;
-                r = runnable.top();
+                r = graph.instances[runnable.top()];
                 runnable.pop();
               }
             }
@@ -363,7 +409,8 @@ int main(int, char **argv) {
   }
   {
     PROFILE(storing info for next run)
-    StoreCache(".bob.cache", fileMap);
+    StoreCache(".bob.cache", fileMap, fileCount);
+    depsLog.Flush();
   }
   {
     PROFILE(build complete)